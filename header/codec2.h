@@ -17,14 +17,109 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 
 void codec2_init();
 void codec2_decode(short speech[], unsigned char *bits);
+void codec2_decode_odd(short speech[], unsigned char *bits);
+void codec2_decode_to(const codec2_sink *sink, unsigned char *bits);
+void codec2_advance(unsigned char *bits, int n);
+int codec2_decode_params(codec2_params *params, unsigned char *bits, int n);
+int codec2_scan_speech(const unsigned char *bits, int n, int e_threshold, int hangover, codec2_segment segments[],
+                       int max_segments);
+
+/* Archive index, only built for hosts */
+int codec2_index_write(const char *path, const unsigned char *bits, int n);
+int codec2_index_open(codec2_index *index, const char *path);
+void codec2_index_close(codec2_index *index);
+int codec2_index_column(const codec2_index *index, int block, int column, uint8_t values[]);
+int codec2_index_find_energy(const codec2_index *index, int e_min, int min_packets, codec2_segment segments[],
+                             int max_segments);
+int codec2_index_find_pitch(const codec2_index *index, int Wo_min, int Wo_max, codec2_segment segments[],
+                            int max_segments);
+
+/* Entropy coded archive, only built for hosts */
+int codec2_archive_write(const char *path, const unsigned char *bits, int n);
+int codec2_archive_block(codec2_archive_workspace *work, const uint8_t *archive, size_t size, int block,
+                         unsigned char *bits);
+int codec2_archive_decode(codec2_archive_workspace *work, const uint8_t *archive, size_t size, int first, int n,
+                          short speech[]);
+
+/* Memory-mapped packet files, only built for hosts */
+int codec2_reader_open(codec2_reader *reader, const char *path, int format, int flags);
+void codec2_reader_close(codec2_reader *reader);
+int codec2_cursor_open(codec2_cursor *cursor, const codec2_reader *reader, uint32_t position);
+void codec2_cursor_close(codec2_cursor *cursor);
+int codec2_cursor_seek(codec2_cursor *cursor, uint32_t position);
+const unsigned char *codec2_cursor_next(codec2_cursor *cursor, int *is_odd);
+int codec2_cursor_decode(codec2_cursor *cursor, short speech[], int n);
+
+/* Broadcast fan-out, only built for hosts */
+int codec2_broadcast_open(codec2_broadcast *broadcast, int pool_size);
+void codec2_broadcast_close(codec2_broadcast *broadcast);
+int codec2_broadcast_publish(codec2_broadcast *broadcast, unsigned char *bits);
+void codec2_subscriber_open(codec2_subscriber *subscriber, codec2_broadcast *broadcast);
+void codec2_subscriber_close(codec2_subscriber *subscriber);
+const void *codec2_subscriber_next(codec2_subscriber *subscriber, int format);
+
+/* Shared cache of decoded archive blocks, only built for hosts. A miss decodes on the global
+   decoder state, so any other decoding while readers run (codec2_decode, cursors, codec2_mix, a
+   broadcast publisher) has to hold codec2_pcm_cache_lock() */
+int codec2_pcm_cache_open(codec2_pcm_cache *cache, size_t bytes);
+void codec2_pcm_cache_close(codec2_pcm_cache *cache);
+int codec2_pcm_cache_read(codec2_pcm_cache *cache, const codec2_reader *reader, uint32_t archive,
+                          const codec2_state *listener, uint32_t position, short speech[], int n);
+void codec2_pcm_cache_lock(codec2_pcm_cache *cache);
+void codec2_pcm_cache_unlock(codec2_pcm_cache *cache);
+void codec2_pcm_cache_stats(codec2_pcm_cache *cache, uint64_t *hits, uint64_t *misses, uint64_t *bytes_saved);
+int codec2_set_fft(const fft_engine *engine);
+void codec2_set_excite(const excite_engine *engine);
+void codec2_lpc_cache_stats(uint32_t *hits, uint32_t *misses);
+void codec2_set_silence_floor(int e_index);
+int codec2_set_output_rate(int hz);
+int codec2_set_speed(int percent);
+int codec2_set_voice(int pitch_percent, int formant_percent);
+void codec2_set_eq(const q31_t curve[]);
+int codec2_eq_curve(q31_t curve[], int count, const int hz[], const int16_t db[]);
+void codec2_set_loudness(int e_index);
+int codec2_samples_per_packet(void);
+uint32_t codec2_settings(const codec2_state *state, codec2_settings_key *key);
+void codec2_default_state(codec2_state *state);
+void codec2_save_state(codec2_state *state);
+void codec2_load_state(const codec2_state *state);
+int codec2_mix(codec2_state *mix, codec2_mix_workspace *work, codec2_state *talkers[], unsigned char *bits[],
+               const q31_t gains[], int count, const codec2_sink *sink);
+int codec2_state_write(const codec2_state *state, uint8_t out[]);
+int codec2_state_read(codec2_state *state, const uint8_t in[], size_t size);
+
+/* FFT engines, fft_cmsis is the default */
+extern const fft_engine fft_cmsis;
+extern const fft_engine fft_split_radix;
+extern const fft_engine fft_float; /* Only built for hosts */
+
+/* Excitation kernels, excite_fixed is the default */
+extern const excite_engine excite_fixed;
+extern const excite_engine excite_vector; /* Only built for hosts */
 
 //////////////////////////////// PRIVATE ///////////////////////////////////////////////
 
+/* FFT, the instances and their tables are generated at build time by tools/gen_fft_tables.py */
+extern const arm_cfft_instance_q31 cfft_256;
+extern const arm_rfft_instance_q31 rfft_512;
+extern const arm_rfft_instance_q31 irfft_512;
+extern const uint8_t bitrev_256[];
+
+void rfft_split(const q31_t z[], const uint8_t order[], q31_t dst[]);
+void irfft_split(q31_t src[], q31_t z[]);
+void irfft_gather(const q31_t z[], const uint8_t order[], int conjugate, q31_t dst[], int first, int count);
+
 /* Sine */
-int synthesise(arm_rfft_instance_q31 *fft, q31_t Sn_[], MODEL *model, const q31_t Pn[]);
+void freq_domain_calc(q31_t Sw_[], MODEL *model, const q31_t eq[]);
+void synthesise_spectrum(const fft_engine *fft, q31_t frame[], q31_t Sw_[], const q31_t Pn[], int n, int rate);
+void synthesise(const fft_engine *fft, q31_t frame[], MODEL *model, const q31_t Pn[], const q31_t eq[], int n,
+                int rate);
+int overlap_add(q31_t Sn_[], const q31_t frame[], int n);
 
 /* Phase */
-void phase_synth(MODEL *model, q31_t *prev_phase, q31_t A[]);
+void phase_synth(const excite_engine *excite, MODEL *model, q31_t *prev_phase, const q31_t H[], int n);
+void phase_skip(MODEL *model, q31_t *prev_phase, int n);
+extern uint32_t lfsr;
 
 /* Interpolate */
 void interpolate_energy(MODEL *new, MODEL *prev, MODEL *current, int index);
@@ -32,7 +127,8 @@ void interpolate_Wo(MODEL *interpolate, MODEL *prev, MODEL *next, int index);
 void interpolate_lsp(q31_t interp[], q31_t prev[], q31_t next[], q31_t index);
 
 /* Quantise */
-void lpc_to_amplitudes(arm_rfft_instance_q31 *arm_fft, q31_t ak[], MODEL *model, q31_t E, q31_t Aw[], int e_index);
+void lpc_to_amplitudes(const fft_engine *fft, q31_t ak[], MODEL *model, uint64_t P[], q31_t H[]);
+void scale_amplitudes(MODEL *model, q31_t E, const uint64_t P[]);
 void lsf_to_lsp(q31_t lsf[], q31_t lsp[]);
 void lsp_to_lpc(q31_t lsp[], q31_t lpc[]);
 void bw_expand_lsps(q31_t lsp[]);
@@ -40,17 +136,32 @@ void check_lsp_order(q31_t lsp[]);
 void decode_lsps_scalar(q31_t lsp[], int indexes[]);
 void apply_lpc_correction(MODEL *model);
 
+/* Geometry */
+const harmonic_geometry *get_harmonic_geometry(const MODEL *model);
+
+/* LPC cache */
+int lpc_cache_lookup(const fft_engine *fft, const q31_t lsf[], const MODEL *model, uint64_t P[], q31_t H[]);
+void lpc_cache_store(const fft_engine *fft, const q31_t lsf[], const MODEL *model, const uint64_t P[], const q31_t H[]);
+
+/* Params */
+void params_init(void);
+
+/* Index */
+void packet_columns(const unsigned char *bits, uint8_t values[]);
+
 /* Main */
-void unpack_and_decode(MODEL model[], codec2_pkt *pkt, q31_t received_lsf[], unsigned char *bits);
-void ear_protection(q31_t sample[], int max_amplitude);
+void unpack_and_decode(MODEL model[], codec2_pkt *pkt, q31_t received_lsf[], unsigned char *bits, int is_odd);
+void interpolate(MODEL model[], MODEL *prev, q31_t prev_lsf[], q31_t received_lsf[], q31_t lsf[][LPC_ORD]);
+int ear_protection(int max_amplitude);
 
 /* Helpers */
 int decode_gray(int num);
 void unpack(unsigned char *input, codec2_pkt *pkt, int is_odd);
 void cordic(int32_t theta, q31_t *sin, q31_t *cos);
 void shift_left(q31_t src[], q31_t dst[], int len);
-void complex_multiply(q31_t a[], q31_t b[], q31_t dst[], int len);
 q63_t estimate_magnitude(q31_t re, q31_t im);
+int32_t log2_q16(uint64_t x);
+uint32_t exp2_q16(int32_t y);
 
 /* Lookup tables */
 extern const int32_t cordic_atan_table[];
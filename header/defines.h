@@ -12,6 +12,7 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 #ifndef __DEFINES__
 #define __DEFINES__
 #include "fxpmath.h"
+#include <stddef.h>
 
 #define N_SPF 80
 #define FFT_SIZE 512
@@ -19,6 +20,7 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 #define LPC_ORD 10
 
 #define P_MAX 160
+#define P_MIN 20
 
 #define MIN_SEP_LOW 5270718   /* 50 x PI / 4000 in Q27 */
 #define MIN_SEP_HIGH 10541436 /* 100 x PI / 4000 in Q27 */
@@ -29,6 +31,46 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 
 #define MAX_PITCH 81920
 #define MAX_L 79
+#define GEOMETRY_CACHE_BITS 5
+#define INDEX_BLOCK 256
+#define ARCHIVE_BLOCK 16384    /* About 11 minutes, long enough to make the tables in front of a block cheap */
+#define ARCHIVE_PROB_BITS 12
+#define ARCHIVE_CONTEXTS 4
+#define READER_READAHEAD 65536 /* Bytes a cursor asks the kernel to read ahead of it */
+#define LFSR_SEED 0xDEADBEEF   /* Noise generator seed */
+#define BROADCAST_RING 64      /* Packets a broadcast keeps for subscribers that fall behind */
+#define PCM_CACHE_BLOCK 250    /* Packets per block of the decoded audio cache, 10 s */
+#define PCM_CACHE_WARMUP 8     /* Packets decoded ahead of a block to settle the decoder */
+#define MAX_SPEED 200                       /* Fastest playback of codec2_set_speed, in percent */
+#define MIN_N_SPF ((N_SPF * 100 + MAX_SPEED / 2) / MAX_SPEED) /* Samples per frame at the fastest */
+#define MAX_N_SPF ((N_SPF * 100 + MIN_SPEED / 2) / MIN_SPEED) /* and slowest speed, rounded like codec2_set_speed */
+#define EQ_BINS HALF_FFT_SIZE               /* Entries of a codec2_set_eq gain curve, one per bin up to 4 kHz */
+#define MIN_VOICE_SCALE 50                  /* Pitch and formant scale range of codec2_set_voice, in percent */
+#define MAX_VOICE_SCALE 200
+#define LOUDNESS_GATE (3 << 16)             /* Frames this much quieter (log2, Q16) leave the loudness alone */
+#define LOUDNESS_ATTACK 2                   /* Loudness moves 1 / 2^ATTACK towards a louder frame, */
+#define LOUDNESS_RELEASE 5                  /* 1 / 2^RELEASE towards a quieter one */
+#define LOUDNESS_SMOOTHING 3                /* Gain moves 1 / 2^SMOOTHING of the way each frame */
+#define LOUDNESS_MAX_BOOST (2 << 16)        /* Gain limits, log2 in Q16 */
+#define LOUDNESS_MAX_CUT (3 << 16)
+#define CODEC2_STATE_VERSION 5
+#define CODEC2_STATE_BYTES (7 + 4 * (3 + MAX_L + 1 + LPC_ORD + 5 + MAX_N_SPF * MAX_RATE)) /* Largest written state */
+
+/* Highest output rate codec2_set_output_rate allows, in samples per 8 kHz sample */
+#ifndef MAX_RATE
+#define MAX_RATE 6
+#endif
+
+/* Slowest playback codec2_set_speed allows, in percent. Sizes the frame buffers, so below 100 it
+   makes them larger */
+#ifndef MIN_SPEED
+#define MIN_SPEED 50
+#endif
+
+/* Entries in the optional LPC envelope cache, 0 leaves it out */
+#ifndef LPC_CACHE_SIZE
+#define LPC_CACHE_SIZE 0
+#endif
 
     /* Structure to hold received params for 4 frames */
     typedef struct
@@ -53,4 +95,284 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
         int voiced;                /* One if this frame is voiced */
     } MODEL;
 
+    /* Everything codec2_decode carries over from one packet to the next */
+    typedef struct
+    {
+        MODEL prev_model;
+        q31_t prev_lsfs[LPC_ORD];
+        q31_t prev_phase;
+        q31_t Sn[2 * MAX_N_SPF * MAX_RATE];
+        uint32_t lfsr;
+        int rate;                  /* Output rate Sn is at, samples per 8 kHz sample */
+        int frame_samples;         /* Samples per frame at 8 kHz, set by the speed */
+        int pitch_scale;           /* Voice transformation in percent */
+        int formant_scale;
+        const q31_t *eq;           /* Gain curve of codec2_set_eq, NULL if flat. Not in the portable form */
+        int32_t loudness_target;   /* Loudness normalisation, see codec2_set_loudness */
+        int32_t loudness;
+        int32_t loudness_gain;
+    } codec2_state;
+
+    /* Accumulators of codec2_mix, kept by the caller so that bridge threads get by with small stacks */
+    typedef struct
+    {
+        q31_t Sw_[NUM_FRAMES][FFT_SIZE * 2 + 1]; /* Summed spectrum of each frame */
+        q31_t frame[2 * MAX_N_SPF * MAX_RATE];   /* Windowed synthesis output of the frame being added */
+    } codec2_mix_workspace;
+
+    /* Sample formats codec2_decode_to writes */
+    enum
+    {
+        CODEC2_SINK_INT16,         /* short */
+        CODEC2_SINK_FLOAT32,       /* float, full scale is -1 .. 1 */
+        CODEC2_SINK_PWM            /* uint32_t PWM compare values, offset binary */
+    };
+
+    /* Where and how codec2_decode_to writes the codec2_samples_per_packet() samples of a packet */
+    typedef struct
+    {
+        int format;                /* CODEC2_SINK_* */
+        void *buffer;              /* First sample of the packet */
+        int stride;                /* Elements from one sample to the next, the channel count for an
+                                      interleaved slot, 1 otherwise */
+        int bits;                  /* PWM: duty cycle resolution, the top bits of the sample */
+        int shift;                 /* PWM: where the duty cycle goes in the word, 16 for channel A */
+        uint32_t constant;         /* PWM: bits set in every word, such as the other channel's duty */
+        int repeat;                /* PWM: words per sample */
+    } codec2_sink;
+
+    /* Columns filled by codec2_decode_params, one entry per 10 ms frame. Any of them can be NULL */
+    typedef struct
+    {
+        uint8_t *voiced;           /* One if the frame is voiced */
+        uint16_t *f0;              /* Fundamental frequency in Hz, Q4, 0 for unvoiced frames */
+        int16_t *energy;           /* Frame energy in dB, Q8, 0 dB being 1.0 in ENERGY_LUT's Q15 */
+        uint8_t *L;                /* Harmonics count */
+        q31_t (*lsf)[LPC_ORD];     /* Line spectral frequencies in radians, Q27 */
+    } codec2_params;
+
+    /* Range of packets holding speech, found by codec2_scan_speech */
+    typedef struct
+    {
+        uint32_t start;            /* First packet */
+        uint32_t end;              /* One past the last packet */
+    } codec2_segment;
+
+    /* Archive index, see index.c. Columns are stored per block of INDEX_BLOCK packets */
+    enum
+    {
+        INDEX_VOICING,             /* 4 voicing bits of the packet, frame 0 in the top bit */
+        INDEX_WO,                  /* Pitch index */
+        INDEX_ENERGY,              /* Energy index */
+        INDEX_LSP,                 /* LSP indexes, INDEX_LSP + i for LSP i */
+        INDEX_COLUMNS = INDEX_LSP + LPC_ORD
+    };
+
+    typedef struct
+    {
+        char magic[4];             /* "C2IX" */
+        uint32_t version;
+        uint32_t packets;
+        uint32_t blocks;
+    } codec2_index_header;
+
+    /* Zone map of one block, the ranges let queries skip blocks without reading them */
+    typedef struct
+    {
+        uint32_t offset;           /* Column data, from the start of the file */
+        uint16_t voiced;           /* Number of voiced frames */
+        uint8_t min[INDEX_COLUMNS];   /* Smallest value of each column, also its base */
+        uint8_t max[INDEX_COLUMNS];   /* Largest value of each column */
+    } codec2_zone;
+
+    typedef struct
+    {
+        const uint8_t *base;       /* The mapped file */
+        size_t size;
+        const codec2_index_header *header;
+        const codec2_zone *zones;
+    } codec2_index;
+
+    /* Entropy coded archive, see archive.c */
+    typedef struct
+    {
+        char magic[4];             /* "C2AR" */
+        uint32_t version;
+        uint32_t packets;
+        uint32_t blocks;
+        uint32_t block_packets;    /* Packets per block, all but the last block are full */
+    } codec2_archive_header;
+
+    /* Static model of one column in one context, rebuilt for every block */
+    typedef struct
+    {
+        uint16_t freq[128];        /* Symbol frequencies, they add up to 1 << ARCHIVE_PROB_BITS */
+        uint16_t start[128];       /* Cumulative frequencies */
+        uint8_t symbol[1 << ARCHIVE_PROB_BITS];   /* Symbol of every slot */
+    } codec2_archive_table;
+
+    /* Scratch of the archive decoder, kept by the caller and reused from block to block so that
+       decoding allocates nothing. One per thread */
+    typedef struct
+    {
+        codec2_archive_table tables[INDEX_COLUMNS * ARCHIVE_CONTEXTS]; /* Models of the block being decoded */
+        unsigned char packets[ARCHIVE_BLOCK * 7];                      /* Its packets, for codec2_archive_decode */
+    } codec2_archive_workspace;
+
+    /* Packet files the reader maps */
+    enum
+    {
+        CODEC2_FORMAT_RAW,         /* 7 bytes per packet, like coded_data[] */
+        CODEC2_FORMAT_DENSE,       /* 13 bytes per pair of packets, the second one starts on byte 6 */
+        CODEC2_FORMAT_ARCHIVE      /* codec2_archive_write output */
+    };
+
+    /* Flags of codec2_reader_open */
+    enum
+    {
+        CODEC2_READER_HUGE_PAGES = 1,  /* Ask for transparent huge pages, where the file system has them */
+        CODEC2_READER_POPULATE = 2     /* Read the whole file in up front */
+    };
+
+    /* A packet file mapped read-only, shared by any number of cursors */
+    typedef struct
+    {
+        const uint8_t *base;
+        size_t size;
+        int format;
+        uint32_t packets;
+    } codec2_reader;
+
+    /* A listener of a reader, with a decoder state of its own */
+    typedef struct
+    {
+        const codec2_reader *reader;
+        uint32_t position;         /* Next packet */
+        size_t readahead;          /* The file is advised up to here */
+        int block;                 /* Archive block in packets, -1 for none */
+        codec2_archive_workspace *archive; /* Decoded archive block and its models, only for archives */
+        codec2_state state;
+    } codec2_cursor;
+
+    /* Sample formats subscribers of a broadcast can ask for */
+    enum
+    {
+        CODEC2_PCM_INT16,          /* short, as decoded */
+        CODEC2_PCM_FLOAT32,        /* float, full scale is -1 .. 1 */
+        CODEC2_PCM_ULAW            /* G.711 mu-law bytes */
+    };
+
+    /* A decoded packet shared by the subscribers of a broadcast, immutable once published */
+    typedef struct
+    {
+        uint32_t refs;             /* References of the ring and subscribers, 0 when free */
+        uint32_t converted;        /* Bit f set once the samples are in CODEC2_PCM_ format f */
+        uint32_t converting;       /* Bit f set once a subscriber started converting to format f */
+        uint64_t sequence;         /* Packet number, UINT64_MAX while the buffer is not published */
+        int count;                 /* Samples */
+        short *pcm;
+        float *f32;
+        uint8_t *ulaw;
+    } codec2_pcm;
+
+    /* One decoded stream fanned out to many subscribers, see broadcast.c */
+    typedef struct
+    {
+        codec2_pcm *pool;          /* Buffers, followed by their samples */
+        int pool_size;
+        int next_free;             /* Where the publisher looks for a free buffer next */
+        codec2_pcm *ring[BROADCAST_RING]; /* Packet n is in ring[n % BROADCAST_RING] */
+        uint64_t published;        /* Packets published so far */
+        int samples;               /* Samples per packet */
+        codec2_state state;        /* Decoder state of the source */
+    } codec2_broadcast;
+
+    /* A listener of a broadcast */
+    typedef struct
+    {
+        codec2_broadcast *broadcast;
+        uint64_t next;             /* Sequence of the next packet */
+        codec2_pcm *held;          /* Packet handed out last, released on the next call */
+        uint64_t lost;             /* Packets skipped for being too slow */
+    } codec2_subscriber;
+
+    /* Real FFT engine, transforms FFT_SIZE real samples back and forth */
+    typedef struct
+    {
+        const char *name;
+        int scale; /* Both directions return the unnormalised transform scaled down by 2^scale */
+
+        /* FFT_SIZE samples in, FFT_SIZE / 2 + 1 complex bins out, src is used as scratch */
+        void (*forward)(q31_t src[], q31_t dst[]);
+
+        /* FFT_SIZE / 2 + 1 complex bins in, time samples first .. first + count - 1 (wrapping
+           around FFT_SIZE) out, src is used as scratch */
+        void (*inverse)(q31_t src[], q31_t dst[], int first, int count);
+    } fft_engine;
+
+    /* Excitation kernel of phase_synth for voiced frames */
+    typedef struct
+    {
+        const char *name;
+
+        /* Excitation of harmonics 1 .. model->L at the fundamental {cos x, sin x} in Q27, filtered
+           by H into model->Af */
+        void (*voiced)(MODEL *model, q31_t cos_x, q31_t sin_x, const q31_t H[]);
+    } excite_engine;
+
+    /* Everything besides the packets that decides the samples decoded, see codec2_settings */
+    typedef struct
+    {
+        int rate;
+        int frame_samples;
+        int pitch_scale;
+        int formant_scale;
+        int32_t loudness_target;
+        q31_t silence_floor;       /* Global, as are the transform and the excitation */
+        const fft_engine *fft;
+        const excite_engine *excite;
+        uint32_t eq;               /* Hash of the equaliser gains, 0 without one */
+    } codec2_settings_key;
+
+    /* A block of decoded audio in a codec2_pcm_cache */
+    typedef struct
+    {
+        uint32_t archive;          /* Key: caller's archive id, block number and decoder settings */
+        uint32_t block;
+        codec2_settings_key settings;
+        uint32_t hash;             /* Of the settings, as codec2_settings returned it */
+        int packets;               /* Packets held, fewer than PCM_CACHE_BLOCK at the end of a file */
+        int samples;               /* Samples per packet */
+        int readers;               /* Copying out of it right now, it stays until they are done */
+        int referenced;            /* Used since the clock hand last passed */
+        int next;                  /* Next entry of the same hash bucket, -1 for none */
+        short *pcm;                /* NULL for an unused entry */
+    } codec2_pcm_block;
+
+    /* Decoded audio of archive blocks, shared by threads, see pcm_cache.c */
+    typedef struct
+    {
+        size_t capacity;           /* Bytes of audio it may hold */
+        size_t used;
+        codec2_pcm_block *entries;
+        int count;                 /* Entries, as many as the smallest blocks would take */
+        int *buckets;              /* First entry of each hash bucket, -1 for none */
+        int bucket_mask;
+        int hand;                  /* Clock hand, next entry to consider for eviction */
+        uint64_t hits, misses, bytes_saved;
+        void *lock;                /* Guards everything above */
+        void *decode_lock;         /* One miss decodes at a time, the decoder keeps global state. Other
+                                      decoders take it with codec2_pcm_cache_lock */
+    } codec2_pcm_cache;
+
+    /* Pitch dependent layout of the harmonics on the FFT grid, cached by get_harmonic_geometry */
+    typedef struct
+    {
+        q31_t Wo;                  /* Wo in Q28, pitch in Q9 and L the frame was built for */
+        q31_t pitch;
+        int L;
+        uint8_t bin[MAX_L + 1];    /* Bin nearest to harmonic m, limited to HALF_FFT_SIZE - 1 */
+        uint16_t edge[MAX_L + 1];  /* Band of harmonic m spans bins edge[m - 1] .. edge[m] - 1 */
+    } harmonic_geometry;
+
 #endif
@@ -14,6 +14,7 @@ typedef int64_t q63_t;
 #define Q18BITS 18
 #define Q23BITS 23
 #define Q27BITS 27
+#define Q28BITS 28
 #define Q31BITS 31
 #define Q32BITS 32
 
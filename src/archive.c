@@ -0,0 +1,523 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Lossless archive of a recording of packed packets, entropy coded with rANS. Consecutive
+    packets are strongly correlated, so every column of the packet (see index.c) is coded as
+    the difference to the same column of the previous packet, modulo its range, with a model
+    picked by a context from the previous packet:
+
+        voicing   the last two voicing bits of the previous packet
+        Wo        whether the last frame of the previous packet and the first frame of this
+                  one are voiced, pitch only carries on across voiced frames
+        others    the top two bits of the previous value
+
+    The models are static per block of ARCHIVE_BLOCK packets, built from the symbol counts
+    and stored in front of the block, so every block decodes on its own and can be reached
+    without touching the ones before it. The 4 spare bits of the packets are not kept, they
+    come back as zeros. The columns are spread over independent rANS streams, which hides the
+    latency of the state updates.
+
+    File layout, in the host byte order:
+
+        codec2_archive_header
+        uint32_t offset of every block from the start of the file, then the end of the file
+        every block: the frequency tables of all its models as varints, a zero frequency is
+        followed by the number of further zeros. Then the sizes of all but the last of the
+        STREAMS rANS streams as varints and the streams, each starting with its state and
+        padded with PACKET_SLACK zeros.
+*/
+
+#define ARCHIVE_VERSION 1
+#define RANS_L (1u << 16)
+#define PROB_SCALE (1 << ARCHIVE_PROB_BITS)
+#define ARCHIVE_TABLES (INDEX_COLUMNS * ARCHIVE_CONTEXTS)
+
+/* Column c is coded in stream c % STREAMS */
+#define STREAMS 4
+
+/* A symbol reads at most one 16 bit word and a packet has at most 4 symbols in any stream,
+   so the decoder only checks for the end of the streams once per packet */
+#define PACKET_SLACK (2 * 4)
+
+/* Largest stream, the state and a word for every symbol. The largest block adds tables of
+   2 byte varints and the sizes of the streams */
+#define STREAM_BYTES (4 + ARCHIVE_BLOCK * 4 * 2)
+#define MAX_BLOCK_BYTES (ARCHIVE_TABLES * 128 * 2 + STREAMS * (5 + STREAM_BYTES + PACKET_SLACK))
+
+/* Bits of each column, in the order of the INDEX_ enum */
+static const uint8_t column_bits[INDEX_COLUMNS] = {4, 7, 5, 4, 4, 4, 4, 4, 4, 4, 3, 3, 2};
+
+/* Scratch of the writer, too big for the stack and allocated per call so writers can run side by side */
+typedef struct
+{
+    codec2_archive_table tables[ARCHIVE_TABLES];
+    uint8_t symbols[ARCHIVE_BLOCK][INDEX_COLUMNS], models[ARCHIVE_BLOCK][INDEX_COLUMNS];
+    uint32_t counts[ARCHIVE_TABLES][128];
+    uint8_t streams[STREAMS][STREAM_BYTES];
+} archive_writer;
+
+static inline int context(int column, const uint8_t prev[], int voicing)
+{
+    if (column == INDEX_VOICING)
+        return prev[INDEX_VOICING] & 3;
+
+    if (column == INDEX_WO)
+        return (prev[INDEX_VOICING] & 1) | ((voicing >> 3) << 1);
+
+    return prev[column] >> (column_bits[column] - 2);
+}
+
+/* Inverse of packet_columns, Gray codes the indexes and packs them like unpack expects them */
+static void pack_columns(const uint8_t values[], unsigned char *bits)
+{
+    uint64_t lsp = 0;
+
+    for (int i = 0; i < LPC_ORD; i++)
+        lsp = (lsp << lsp_bits[i]) | (values[INDEX_LSP + i] ^ (values[INDEX_LSP + i] >> 1));
+
+    uint64_t out = ((uint64_t)values[INDEX_VOICING] << 52) |
+                   ((uint64_t)(values[INDEX_WO] ^ (values[INDEX_WO] >> 1)) << 45) |
+                   ((uint64_t)(values[INDEX_ENERGY] ^ (values[INDEX_ENERGY] >> 1)) << 40) | (lsp << 4);
+
+    for (int i = 0; i < 7; i++)
+        bits[i] = out >> (48 - 8 * i);
+}
+
+static int put_varint(uint8_t out[], uint32_t value)
+{
+    int size = 0;
+
+    for (; value >= 0x80; value >>= 7)
+        out[size++] = value | 0x80;
+
+    out[size++] = value;
+    return size;
+}
+
+static const uint8_t *get_varint(const uint8_t *in, const uint8_t *end, uint32_t *value)
+{
+    *value = 0;
+
+    for (int shift = 0; in < end && shift < 28; shift += 7)
+    {
+        *value |= (uint32_t)(*in & 0x7f) << shift;
+
+        if (!(*in++ & 0x80))
+            return in;
+    }
+
+    return NULL;
+}
+
+/*
+    Scale the counts to frequencies adding up to PROB_SCALE. Every symbol seen keeps at least 1,
+    the most frequent symbols pay for rounding up the rare ones.
+*/
+static void normalise(const uint32_t count[], int symbols, uint16_t freq[])
+{
+    uint32_t total = 0;
+    int sum = 0, largest = 0;
+
+    for (int s = 0; s < symbols; s++)
+        total += count[s];
+
+    if (!total)
+    {
+        memset(freq, 0, symbols * sizeof(freq[0]));
+        return;
+    }
+
+    for (int s = 0; s < symbols; s++)
+    {
+        freq[s] = I64(count[s]) * PROB_SCALE / total;
+
+        if (count[s] && !freq[s])
+            freq[s] = 1;
+
+        sum += freq[s];
+    }
+
+    for (; sum > PROB_SCALE; sum--)
+    {
+        for (int s = 0; s < symbols; s++)
+            if (freq[s] > freq[largest])
+                largest = s;
+
+        freq[largest]--;
+    }
+
+    for (int s = 0; s < symbols; s++)
+        if (freq[s] > freq[largest])
+            largest = s;
+
+    freq[largest] += PROB_SCALE - sum;
+}
+
+static void rans_put(uint32_t *x, uint8_t **ptr, uint32_t start, uint32_t freq)
+{
+    /* 2^32 for a symbol that is all of its model */
+    uint64_t x_max = I64((RANS_L >> ARCHIVE_PROB_BITS) << 16) * freq;
+
+    if (*x >= x_max)
+    {
+        *ptr -= 2;
+        (*ptr)[0] = *x;
+        (*ptr)[1] = *x >> 8;
+        *x >>= 16;
+    }
+
+    *x = ((*x / freq) << ARCHIVE_PROB_BITS) + (*x % freq) + start;
+}
+
+/*
+    The state stays in RANS_L .. 2^32 - 1, so after a symbol at most one 16 bit word is
+    needed to get back up there. The read is done unconditionally and only kept if it was
+    needed, a branch on it would be mispredicted half of the time.
+*/
+static inline int rans_get(const codec2_archive_table *table, uint32_t *x, const uint8_t **ptr)
+{
+    uint32_t slot = *x & (PROB_SCALE - 1);
+    int s = table->symbol[slot];
+
+    *x = table->freq[s] * (*x >> ARCHIVE_PROB_BITS) + slot - table->start[s];
+
+    uint32_t word = (*ptr)[0] | ((*ptr)[1] << 8);
+    int renorm = *x < RANS_L;
+
+    *x = (*x << (renorm << 4)) | (word & -renorm);
+    *ptr += renorm << 1;
+    return s;
+}
+
+/* Code one block of count packets, returns the number of bytes written to data */
+static int pack_block(archive_writer *writer, const unsigned char *bits, int count, uint8_t data[])
+{
+    uint8_t(*symbols)[INDEX_COLUMNS] = writer->symbols, (*models)[INDEX_COLUMNS] = writer->models;
+    uint32_t(*counts)[128] = writer->counts;
+    uint8_t(*streams)[STREAM_BYTES] = writer->streams;
+    uint8_t prev[INDEX_COLUMNS] = {0}, values[INDEX_COLUMNS];
+    int size = 0;
+
+    memset(counts, 0, sizeof(writer->counts));
+
+    for (int k = 0; k < count; k++, bits += 7)
+    {
+        packet_columns(bits, values);
+
+        for (int c = 0; c < INDEX_COLUMNS; c++)
+        {
+            symbols[k][c] = (values[c] - (c == INDEX_VOICING ? 0 : prev[c])) & ((1 << column_bits[c]) - 1);
+            models[k][c] = c * ARCHIVE_CONTEXTS + context(c, prev, values[INDEX_VOICING]);
+            counts[models[k][c]][symbols[k][c]]++;
+        }
+
+        memcpy(prev, values, sizeof(prev));
+    }
+
+    for (int t = 0; t < ARCHIVE_TABLES; t++)
+    {
+        codec2_archive_table *table = &writer->tables[t];
+        int alphabet = 1 << column_bits[t / ARCHIVE_CONTEXTS];
+
+        normalise(counts[t], alphabet, table->freq);
+
+        for (int s = 0, start = 0; s < alphabet; start += table->freq[s++])
+            table->start[s] = start;
+
+        for (int s = 0; s < alphabet; s++)
+        {
+            size += put_varint(&data[size], table->freq[s]);
+
+            if (table->freq[s])
+                continue;
+
+            int run = 1;
+
+            while (s + run < alphabet && !table->freq[s + run])
+                run++;
+
+            size += put_varint(&data[size], run - 1);
+            s += run - 1;
+        }
+    }
+
+    /* rANS codes backwards, with the last symbol first. Each state has a stream of its own,
+       so the decoder can follow all of them at once */
+    uint8_t *ptr[STREAMS];
+    uint32_t x[STREAMS];
+
+    for (int i = 0; i < STREAMS; i++)
+    {
+        ptr[i] = &streams[i][STREAM_BYTES];
+        x[i] = RANS_L;
+    }
+
+    for (int k = count - 1; k >= 0; k--)
+    {
+        for (int c = INDEX_COLUMNS - 1; c >= 0; c--)
+        {
+            const codec2_archive_table *table = &writer->tables[models[k][c]];
+            rans_put(&x[c % STREAMS], &ptr[c % STREAMS], table->start[symbols[k][c]], table->freq[symbols[k][c]]);
+        }
+    }
+
+    for (int i = 0; i < STREAMS; i++)
+    {
+        ptr[i] -= 4;
+
+        for (int b = 0; b < 4; b++)
+            ptr[i][b] = x[i] >> (8 * b);
+    }
+
+    for (int i = 0; i < STREAMS - 1; i++)
+        size += put_varint(&data[size], &streams[i][STREAM_BYTES] - ptr[i]);
+
+    for (int i = 0; i < STREAMS; i++)
+    {
+        memcpy(&data[size], ptr[i], &streams[i][STREAM_BYTES] - ptr[i]);
+        size += &streams[i][STREAM_BYTES] - ptr[i];
+
+        memset(&data[size], 0, PACKET_SLACK);
+        size += PACKET_SLACK;
+    }
+
+    return size;
+}
+
+/* Build the archive of n packets (7 bytes each) into a new file, returns 0 on success */
+int codec2_archive_write(const char *path, const unsigned char *bits, int n)
+{
+    codec2_archive_header header = {{'C', '2', 'A', 'R'}, ARCHIVE_VERSION, n, (n + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK,
+                                    ARCHIVE_BLOCK};
+    uint32_t *offsets = calloc(header.blocks + 1, sizeof(uint32_t));
+    uint8_t *data = malloc(MAX_BLOCK_BYTES);
+    archive_writer *writer = malloc(sizeof(archive_writer));
+    FILE *f = fopen(path, "wb");
+    int error = !f || !offsets || !data || !writer;
+
+    uint32_t offset = sizeof(header) + (header.blocks + 1) * sizeof(uint32_t);
+
+    /* Blocks first, the offsets are written once they are known */
+    if (!error)
+        error = fseek(f, offset, SEEK_SET);
+
+    for (uint32_t b = 0; b < header.blocks && !error; b++)
+    {
+        int count = (n - b * ARCHIVE_BLOCK < ARCHIVE_BLOCK) ? n - b * ARCHIVE_BLOCK : ARCHIVE_BLOCK;
+        int size = pack_block(writer, &bits[7 * b * ARCHIVE_BLOCK], count, data);
+
+        offsets[b] = offset;
+        offset += size;
+
+        error = fwrite(data, 1, size, f) != (size_t)size;
+    }
+
+    offsets[header.blocks] = offset;
+
+    if (!error)
+        error = fseek(f, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, f) != 1 ||
+                fwrite(offsets, sizeof(uint32_t), header.blocks + 1, f) != header.blocks + 1;
+
+    if (f && fclose(f))
+        error = 1;
+
+    free(offsets);
+    free(data);
+    free(writer);
+    return error ? -1 : 0;
+}
+
+static const codec2_archive_header *archive_header(const uint8_t *archive, size_t size)
+{
+    const codec2_archive_header *header = (const codec2_archive_header *)archive;
+
+    if (size < sizeof(codec2_archive_header) || memcmp(header->magic, "C2AR", 4) ||
+        header->version != ARCHIVE_VERSION || header->block_packets < 1 || header->block_packets > ARCHIVE_BLOCK ||
+        size < sizeof(codec2_archive_header) + (header->blocks + (size_t)1) * sizeof(uint32_t))
+        return NULL;
+
+    return header;
+}
+
+/* Read the frequency tables of a block and fill in the slots, returns the start of the stream */
+static const uint8_t *read_tables(codec2_archive_table tables[], const uint8_t *ptr, const uint8_t *end)
+{
+    for (int t = 0; t < ARCHIVE_TABLES && ptr; t++)
+    {
+        codec2_archive_table *table = &tables[t];
+        int symbols = 1 << column_bits[t / ARCHIVE_CONTEXTS];
+        uint32_t start = 0, value;
+
+        for (int s = 0; s < symbols && ptr; s++)
+        {
+            if (!(ptr = get_varint(ptr, end, &value)) || value > PROB_SCALE - start)
+                return NULL;
+
+            table->freq[s] = value;
+            table->start[s] = start;
+            memset(&table->symbol[start], s, value);
+            start += value;
+
+            if (value)
+                continue;
+
+            if (!(ptr = get_varint(ptr, end, &value)) || value >= (uint32_t)(symbols - s))
+                return NULL;
+
+            for (; value; value--)
+            {
+                table->freq[++s] = 0;
+                table->start[s] = start;
+            }
+        }
+
+        /* A model the block never used, decoding with it must still keep the state valid */
+        if (!start)
+        {
+            table->freq[0] = PROB_SCALE;
+            memset(table->symbol, 0, PROB_SCALE);
+        }
+        else if (start != PROB_SCALE)
+            return NULL;
+    }
+
+    return ptr;
+}
+
+/* Decode one block with the models in tables, see codec2_archive_block */
+static int unpack_block(codec2_archive_table tables[], const codec2_archive_header *header, const uint8_t *archive,
+                        size_t size, int block, unsigned char *bits)
+{
+    const uint32_t *offsets = (const uint32_t *)(archive + sizeof(codec2_archive_header));
+
+    if (offsets[block] > offsets[block + 1] || offsets[block + 1] > size)
+        return -1;
+
+    const uint8_t *end = archive + offsets[block + 1];
+    const uint8_t *ptr = read_tables(tables, archive + offsets[block], end);
+    const uint8_t *stream[STREAMS + 1];
+    uint32_t x[STREAMS], sizes[STREAMS];
+
+    for (int i = 0; i < STREAMS - 1 && ptr; i++)
+        ptr = get_varint(ptr, end, &sizes[i]);
+
+    if (!ptr)
+        return -1;
+
+    /* stream[i] .. stream[i + 1] - 1 is stream i and its padding */
+    stream[0] = ptr;
+
+    for (int i = 0; i < STREAMS; i++)
+    {
+        if (i == STREAMS - 1)
+            sizes[i] = (end - stream[i] >= PACKET_SLACK) ? end - stream[i] - PACKET_SLACK : 0;
+
+        if (sizes[i] < 4 || end - stream[i] < (ptrdiff_t)sizes[i] + PACKET_SLACK)
+            return -1;
+
+        stream[i + 1] = stream[i] + sizes[i] + PACKET_SLACK;
+        x[i] = stream[i][0] | (stream[i][1] << 8) | (stream[i][2] << 16) | ((uint32_t)stream[i][3] << 24);
+
+        if (x[i] < RANS_L)
+            return -1;
+    }
+
+    const uint8_t *ptr0 = stream[0] + 4, *ptr1 = stream[1] + 4, *ptr2 = stream[2] + 4, *ptr3 = stream[3] + 4;
+    uint32_t x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3];
+    uint32_t first = block * header->block_packets;
+    int count = (header->packets - first < header->block_packets) ? header->packets - first : header->block_packets;
+    uint8_t values[INDEX_COLUMNS] = {0};
+
+    for (int k = 0; k < count; k++, bits += 7)
+    {
+        if (stream[1] - ptr0 < PACKET_SLACK || stream[2] - ptr1 < PACKET_SLACK || stream[3] - ptr2 < PACKET_SLACK ||
+            stream[4] - ptr3 < PACKET_SLACK)
+            return -1;
+
+        /* values[] still holds the previous packet, which the contexts are taken from. Each
+           column of a group of 4 is in another stream, so they are decoded side by side */
+        int voicing = rans_get(&tables[context(INDEX_VOICING, values, 0)], &x0, &ptr0);
+
+        for (int c = 1; c < INDEX_COLUMNS; c += STREAMS)
+        {
+            const codec2_archive_table *table1 = &tables[c * ARCHIVE_CONTEXTS + context(c, values, voicing)];
+            const codec2_archive_table *table2 = &tables[(c + 1) * ARCHIVE_CONTEXTS + context(c + 1, values, 0)];
+            const codec2_archive_table *table3 = &tables[(c + 2) * ARCHIVE_CONTEXTS + context(c + 2, values, 0)];
+            const codec2_archive_table *table0 = &tables[(c + 3) * ARCHIVE_CONTEXTS + context(c + 3, values, 0)];
+
+            values[c] = (values[c] + rans_get(table1, &x1, &ptr1)) & ((1 << column_bits[c]) - 1);
+            values[c + 1] = (values[c + 1] + rans_get(table2, &x2, &ptr2)) & ((1 << column_bits[c + 1]) - 1);
+            values[c + 2] = (values[c + 2] + rans_get(table3, &x3, &ptr3)) & ((1 << column_bits[c + 2]) - 1);
+            values[c + 3] = (values[c + 3] + rans_get(table0, &x0, &ptr0)) & ((1 << column_bits[c + 3]) - 1);
+        }
+
+        values[INDEX_VOICING] = voicing;
+
+        pack_columns(values, bits);
+    }
+
+    return count;
+}
+
+/*
+    Decode one block of the archive into packed packets, returns the number of packets or -1.
+    The models are rebuilt for every block in work, so any number of threads can decode blocks
+    of the same or other archives at once, each with a workspace of its own.
+*/
+int codec2_archive_block(codec2_archive_workspace *work, const uint8_t *archive, size_t size, int block,
+                         unsigned char *bits)
+{
+    const codec2_archive_header *header = archive_header(archive, size);
+
+    if (!header || block < 0 || (uint32_t)block >= header->blocks)
+        return -1;
+
+    return unpack_block(work->tables, header, archive, size, block, bits);
+}
+
+/*
+    Decode packets first .. first + n - 1 of the archive into speech through codec2_decode,
+    codec2_samples_per_packet() samples per packet, one block at a time through work. Like
+    codec2_decode it carries on from the current decoder state. Returns the number of packets
+    decoded or -1.
+*/
+int codec2_archive_decode(codec2_archive_workspace *work, const uint8_t *archive, size_t size, int first, int n,
+                          short speech[])
+{
+    const codec2_archive_header *header = archive_header(archive, size);
+
+    if (!header || first < 0 || n < 0 || (uint32_t)first + n > header->packets)
+        return -1;
+
+    for (int done = 0; done < n;)
+    {
+        int block = (first + done) / header->block_packets;
+        int skip = (first + done) - block * header->block_packets;
+        int count = codec2_archive_block(work, archive, size, block, work->packets);
+
+        if (count < 0)
+            return -1;
+
+        for (int k = skip; k < count && done < n; k++, done++, speech += codec2_samples_per_packet())
+            codec2_decode(speech, &work->packets[7 * k]);
+    }
+
+    return n;
+}
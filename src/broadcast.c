@@ -0,0 +1,274 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <sched.h>
+#include <stdlib.h>
+
+/*
+    Fan-out of one decoded stream to any number of subscribers, for rebroadcasts and live
+    listening. The source is decoded once per packet into a buffer from a pool, and the last
+    BROADCAST_RING buffers are kept in a ring that subscribers read from at their own pace.
+    A subscriber that falls more than the ring behind skips ahead and counts what it lost, so
+    the publisher never waits for anyone.
+
+    Buffers are immutable once published and reference counted: the ring holds one reference,
+    every subscriber one on the packet it was handed last. The publisher only takes buffers
+    nobody references. A subscriber may reach a buffer through the ring just as it is replaced,
+    so it only takes a reference while there are others, and then checks the buffer still holds
+    the packet it asked for. The publisher marks the sequence invalid before dropping the ring's
+    reference, which closes the gap.
+
+    Samples are kept as decoded, other formats are converted by the first subscriber asking for
+    them and shared by the rest. One thread publishes (it uses the decoder, which keeps global
+    state), subscribers can be on any threads.
+*/
+
+#define INVALID_SEQUENCE UINT64_MAX
+
+/* G.711 mu-law of a sample */
+static uint8_t mulaw(int sample)
+{
+    int sign = (sample < 0) ? 0x80 : 0;
+
+    if (sign)
+        sample = -sample;
+
+    if (sample > 32635)
+        sample = 32635;
+
+    sample += 0x84;
+
+    int exponent = 7;
+
+    for (int mask = 0x4000; !(sample & mask) && exponent > 0; mask >>= 1)
+        exponent--;
+
+    return ~(sign | (exponent << 4) | ((sample >> (exponent + 3)) & 0x0f));
+}
+
+/* Take a reference on a buffer someone else references, 0 if it has none left */
+static int acquire(codec2_pcm *pcm)
+{
+    uint32_t refs = __atomic_load_n(&pcm->refs, __ATOMIC_SEQ_CST);
+
+    while (refs)
+        if (__atomic_compare_exchange_n(&pcm->refs, &refs, refs + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return 1;
+
+    return 0;
+}
+
+static void release(codec2_pcm *pcm)
+{
+    __atomic_fetch_sub(&pcm->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+/* A free buffer for the publisher, NULL if subscribers hold all of them */
+static codec2_pcm *take_free(codec2_broadcast *broadcast)
+{
+    for (int i = 0; i < broadcast->pool_size; i++)
+    {
+        codec2_pcm *pcm = &broadcast->pool[broadcast->next_free];
+        uint32_t free_refs = 0;
+
+        broadcast->next_free = (broadcast->next_free + 1) % broadcast->pool_size;
+
+        if (__atomic_compare_exchange_n(&pcm->refs, &free_refs, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return pcm;
+    }
+
+    return NULL;
+}
+
+/*
+    Set up a broadcast of a stream decoded at the current output rate, speed and voice settings.
+    pool_size buffers are allocated, more than BROADCAST_RING, the rest is what subscribers can
+    hold on to at once. Returns 0 or -1.
+*/
+int codec2_broadcast_open(codec2_broadcast *broadcast, int pool_size)
+{
+    if (pool_size <= BROADCAST_RING)
+        return -1;
+
+    const int samples = codec2_samples_per_packet();
+    const size_t bytes = sizeof(short) + sizeof(float) + sizeof(uint8_t);
+
+    broadcast->pool = calloc(pool_size, sizeof(codec2_pcm) + samples * bytes);
+
+    if (!broadcast->pool)
+        return -1;
+
+    /* Samples of all buffers after the buffers themselves, widest format first. A packet has a
+       multiple of 4 samples, so every buffer's floats stay aligned */
+    uint8_t *memory = (uint8_t *)&broadcast->pool[pool_size];
+
+    for (int i = 0; i < pool_size; i++, memory += samples * bytes)
+    {
+        codec2_pcm *pcm = &broadcast->pool[i];
+
+        pcm->count = samples;
+        pcm->sequence = INVALID_SEQUENCE;
+        pcm->f32 = (float *)memory;
+        pcm->pcm = (short *)(memory + samples * sizeof(float));
+        pcm->ulaw = memory + samples * (sizeof(float) + sizeof(short));
+    }
+
+    for (int i = 0; i < BROADCAST_RING; i++)
+        broadcast->ring[i] = NULL;
+
+    broadcast->pool_size = pool_size;
+    broadcast->next_free = 0;
+    broadcast->published = 0;
+    broadcast->samples = samples;
+    codec2_default_state(&broadcast->state);
+    return 0;
+}
+
+/* Free the buffers, once no subscriber uses the broadcast any more */
+void codec2_broadcast_close(codec2_broadcast *broadcast)
+{
+    free(broadcast->pool);
+    broadcast->pool = NULL;
+}
+
+/* Decode a packet (7 bytes) and hand it to the subscribers, returns 0 or -1 if no buffer is free */
+int codec2_broadcast_publish(codec2_broadcast *broadcast, unsigned char *bits)
+{
+    codec2_pcm *pcm = take_free(broadcast);
+
+    if (!pcm)
+        return -1;
+
+    uint64_t sequence = broadcast->published;
+
+    codec2_load_state(&broadcast->state);
+    codec2_decode(pcm->pcm, bits);
+    codec2_save_state(&broadcast->state);
+
+    pcm->converted = 0;
+    pcm->converting = 0;
+    __atomic_store_n(&pcm->sequence, sequence, __ATOMIC_SEQ_CST);
+
+    codec2_pcm **slot = &broadcast->ring[sequence % BROADCAST_RING];
+    codec2_pcm *old = __atomic_exchange_n(slot, pcm, __ATOMIC_SEQ_CST);
+
+    if (old)
+    {
+        __atomic_store_n(&old->sequence, INVALID_SEQUENCE, __ATOMIC_SEQ_CST);
+        release(old);
+    }
+
+    __atomic_store_n(&broadcast->published, sequence + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/* Start listening at the live edge, the next packet published is the first one handed out */
+void codec2_subscriber_open(codec2_subscriber *subscriber, codec2_broadcast *broadcast)
+{
+    subscriber->broadcast = broadcast;
+    subscriber->next = __atomic_load_n(&broadcast->published, __ATOMIC_SEQ_CST);
+    subscriber->held = NULL;
+    subscriber->lost = 0;
+}
+
+void codec2_subscriber_close(codec2_subscriber *subscriber)
+{
+    if (subscriber->held)
+        release(subscriber->held);
+
+    subscriber->held = NULL;
+}
+
+/* The samples of a buffer in format, converted on first use */
+static const void *samples_as(codec2_pcm *pcm, int format)
+{
+    if (format == CODEC2_PCM_INT16)
+        return pcm->pcm;
+
+    const uint32_t bit = 1u << format;
+
+    if (!(__atomic_load_n(&pcm->converted, __ATOMIC_ACQUIRE) & bit))
+    {
+        if (!(__atomic_fetch_or(&pcm->converting, bit, __ATOMIC_ACQ_REL) & bit))
+        {
+            for (int i = 0; i < pcm->count; i++)
+            {
+                if (format == CODEC2_PCM_FLOAT32)
+                    pcm->f32[i] = pcm->pcm[i] * (1.0f / 32768);
+                else
+                    pcm->ulaw[i] = mulaw(pcm->pcm[i]);
+            }
+
+            __atomic_fetch_or(&pcm->converted, bit, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            /* Another subscriber is on it, a few microseconds at most */
+            while (!(__atomic_load_n(&pcm->converted, __ATOMIC_ACQUIRE) & bit))
+                sched_yield();
+        }
+    }
+
+    return (format == CODEC2_PCM_FLOAT32) ? (const void *)pcm->f32 : (const void *)pcm->ulaw;
+}
+
+/*
+    The next packet's samples in format (CODEC2_PCM_*), broadcast->samples of them, or NULL
+    if nothing new was published. They stay valid until the next call or codec2_subscriber_close.
+    Packets the subscriber was too slow for are skipped and added to subscriber->lost.
+*/
+const void *codec2_subscriber_next(codec2_subscriber *subscriber, int format)
+{
+    codec2_broadcast *broadcast = subscriber->broadcast;
+
+    if (subscriber->held)
+        release(subscriber->held);
+
+    subscriber->held = NULL;
+
+    for (;;)
+    {
+        uint64_t published = __atomic_load_n(&broadcast->published, __ATOMIC_SEQ_CST);
+        uint64_t sequence = subscriber->next;
+
+        if (sequence >= published)
+            return NULL;
+
+        /* Lapped, carry on from the oldest packet still in the ring */
+        if (published - sequence > BROADCAST_RING)
+        {
+            subscriber->lost += published - BROADCAST_RING - sequence;
+            subscriber->next = sequence = published - BROADCAST_RING;
+        }
+
+        codec2_pcm *pcm = __atomic_load_n(&broadcast->ring[sequence % BROADCAST_RING], __ATOMIC_SEQ_CST);
+
+        if (pcm && acquire(pcm))
+        {
+            if (__atomic_load_n(&pcm->sequence, __ATOMIC_SEQ_CST) == sequence)
+            {
+                subscriber->held = pcm;
+                subscriber->next = sequence + 1;
+                return samples_as(pcm, format);
+            }
+
+            release(pcm);
+        }
+
+        /* Replaced while we got to it, the publisher has moved on by a ring since */
+        subscriber->lost++;
+        subscriber->next = sequence + 1;
+    }
+}
@@ -13,44 +13,378 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 #include "defines.h"
 #include "fxpmath.h"
 
-/* FFT instances from the ARM CMSIS FFT routines */
-arm_rfft_instance_q31 fft;
-arm_rfft_instance_q31 inverse_fft;
+#include <string.h>
+
+/* FFT engine used for both transforms, can be switched with codec2_set_fft */
+const fft_engine *fft = &fft_cmsis;
+
+/* Excitation of voiced frames, can be switched with codec2_set_excite */
+const excite_engine *excite = &excite_fixed;
 
 /* Initialize the previous model struct with some defaults */
 MODEL prev_model = {.Wo = TAU_Q28 / P_MAX, .pitch = MAX_PITCH, .L = MAX_L, .energy = ONE_IN_Q12};
 
-q31_t Sn[4 * N_SPF] = {0}; /* Speech samples in time domain */
+q31_t Sn[2 * MAX_N_SPF * MAX_RATE] = {0}; /* Speech samples in time domain */
 q31_t prev_phase = 0;      /* Previous phase value */
 q31_t prev_lsfs[LPC_ORD];  /* Previous line spectral frequencies received */
 
+q31_t silence_floor = 0; /* Frames with less energy are not synthesised, 0 disables */
+int output_rate = 1;     /* Output samples per 8 kHz sample */
+int frame_samples = N_SPF; /* Samples per frame at 8 kHz, N_SPF at normal speed */
+int pitch_scale = 100;     /* Voice transformation in percent, see codec2_set_voice */
+int formant_scale = 100;
+const q31_t *eq_curve = NULL; /* Gain of each bin, see codec2_set_eq */
+
+int32_t loudness_target = 0; /* Energy to normalise to, log2 in Q16, 0 disables */
+int32_t loudness = 0;        /* Short-term loudness, log2 of the energy in Q16, 0 before the first frame */
+int32_t loudness_gain = 0;   /* Gain on the frame energy, log2 in Q16 */
+
 void codec2_init()
 {
-    /* Initialize FFT structures */
-    arm_rfft_init_q31(&fft, FFT_SIZE, 0, 1);
-    arm_rfft_init_q31(&inverse_fft, FFT_SIZE, 1, 1);
-
     /* Set the starting LSPS values so there is no initial "click" in the decoding */
     for (int i = 0; i < LPC_ORD; i++)
         prev_lsfs[i] = i * (TAU_Q26 / (LPC_ORD + 1));
+
+    params_init();
+}
+
+int codec2_set_fft(const fft_engine *engine)
+{
+    /* All of the fixed point math around the transforms assumes this scaling */
+    if (engine->scale != Q9BITS)
+        return -1;
+
+    fft = engine;
+    return 0;
+}
+
+/* Pick the kernel that excites the harmonics of voiced frames */
+void codec2_set_excite(const excite_engine *engine)
+{
+    excite = engine;
+}
+
+/* Frames quieter than ENERGY_LUT[e_index] come out as silence, 0 turns this off */
+void codec2_set_silence_floor(int e_index)
+{
+    if (e_index > 31)
+        e_index = 31;
+
+    silence_floor = (e_index > 0) ? ENERGY_LUT[e_index] : 0;
+}
+
+/*
+    Synthesise hz / 8000 samples per 8 kHz sample straight from the model, hz a multiple of
+    8000 up to MAX_RATE * 8000 (16000 and 48000 for example), instead of resampling the 8 kHz
+    output. Nothing is added above 4 kHz. Switching rates drops the overlap with the previous
+    packet, so set it before decoding. Returns 0 or -1 if the rate is not supported.
+*/
+int codec2_set_output_rate(int hz)
+{
+    int rate = hz / 8000;
+
+    if (hz % 8000 || rate < 1 || rate > MAX_RATE)
+        return -1;
+
+    if (rate != output_rate)
+        memset(Sn, 0, sizeof(Sn));
+
+    output_rate = rate;
+    return 0;
+}
+
+/*
+    Play back at percent (MIN_SPEED .. MAX_SPEED) of normal speed by changing how long each frame
+    lasts: 125 makes 64 sample frames instead of N_SPF. The pitch stays the same, as the phase
+    advances by the same Wo per sample. The tail of the last frame is stretched to the new length,
+    so speed can change mid-stream without a click. Returns 0 or -1 if out of range.
+*/
+int codec2_set_speed(int percent)
+{
+    if (percent < MIN_SPEED || percent > MAX_SPEED)
+        return -1;
+
+    int n = (N_SPF * 100 + percent / 2) / percent;
+
+    if (n != frame_samples)
+    {
+        int from = frame_samples * output_rate, to = n * output_rate;
+        q31_t tail[MAX_N_SPF * MAX_RATE];
+
+        memcpy(tail, &Sn[from], from * sizeof(q31_t));
+
+        for (int i = 0; i < to; i++)
+            Sn[to + i] = tail[i * from / to];
+
+        frame_samples = n;
+    }
+
+    return 0;
 }
 
-void ear_protection(q31_t sample[], int max_amplitude)
+/*
+    Transform the voice, for privacy masking for example: pitch_percent moves the fundamental of
+    voiced frames while the spectral envelope stays, formant_percent moves the envelope (the
+    formants) while the pitch stays. Both range from MIN_VOICE_SCALE to MAX_VOICE_SCALE percent,
+    100 leaves the voice alone. Returns 0 or -1 if out of range.
+*/
+int codec2_set_voice(int pitch_percent, int formant_percent)
+{
+    if (pitch_percent < MIN_VOICE_SCALE || pitch_percent > MAX_VOICE_SCALE || formant_percent < MIN_VOICE_SCALE ||
+        formant_percent > MAX_VOICE_SCALE)
+        return -1;
+
+    pitch_scale = pitch_percent;
+    formant_scale = formant_percent;
+    return 0;
+}
+
+/*
+    Shape the output with a fixed response, a telephone band pass or speaker compensation for
+    example, at no cost in the time domain: each harmonic's amplitude is multiplied by the gain of
+    its bin right before synthesis. curve holds EQ_BINS gains in Q16, bin k being at k * 8000 /
+    FFT_SIZE Hz, and must stay around while in use. NULL turns the equaliser off.
+*/
+void codec2_set_eq(const q31_t curve[])
+{
+    eq_curve = curve;
+}
+
+/*
+    Fill curve for codec2_set_eq from count points, hz ascending and db the gain there in dB, Q8.
+    The gain is interpolated linearly in dB between points and held beyond the first and last.
+    Returns 0 or -1 if the points are not in order.
+*/
+int codec2_eq_curve(q31_t curve[], int count, const int hz[], const int16_t db[])
 {
-    if (max_amplitude > LIMIT_THRESH)
+    if (count < 1)
+        return -1;
+
+    for (int i = 1; i < count; i++)
+        if (hz[i] <= hz[i - 1])
+            return -1;
+
+    for (int k = 0, i = 0; k < EQ_BINS; k++)
     {
-        int scaling_factor = (LIMIT_THRESH * LIMIT_THRESH) / max_amplitude;
-        scaling_factor = (scaling_factor << Q15BITS) / max_amplitude;
+        int f = (k * 8000) / FFT_SIZE;
+
+        while (i < count && hz[i] <= f)
+            i++;
+
+        int32_t gain = (i == 0) ? db[0] : (i == count) ? db[count - 1]
+                     : db[i - 1] + ((db[i] - db[i - 1]) * (f - hz[i - 1])) / (hz[i] - hz[i - 1]);
+
+        /* dB in Q8 to log2 in Q16, 65536 / 6.0206 = 10885, kept within what Q16 holds */
+        int32_t log_gain = (I64(gain) * 10885) >> 8;
+        log_gain = SAT_PLUS(SAT_MINUS(log_gain, (16 << 16)), (15 << 16));
 
-        for (int i = 0; i < N_SPF; i++)
-            sample[i] = (sample[i] * scaling_factor) >> Q15BITS;
+        curve[k] = exp2_q16(log_gain);
     }
+
+    return 0;
 }
 
-void unpack_and_decode(MODEL model[], codec2_pkt *pkt, q31_t received_lsf[], unsigned char *bits)
+/*
+    Bring streams of any level to about ENERGY_LUT[e_index], so players need no AGC after the
+    decoder. The loudness is tracked from the frame energies before synthesis and a smoothed gain
+    on the energy follows it, within LOUDNESS_MAX_BOOST and LOUDNESS_MAX_CUT. Ear protection is
+    left to catch what gets through. 0 turns it off.
+*/
+void codec2_set_loudness(int e_index)
+{
+    if (e_index > 31)
+        e_index = 31;
+
+    loudness_target = (e_index > 0) ? log2_q16(ENERGY_LUT[e_index]) : 0;
+}
+
+/* Track the loudness with the energy of a frame about to be synthesised, returns the energy to use */
+static q31_t normalise_loudness(q31_t energy)
+{
+    if (!loudness_target)
+        return energy;
+
+    int32_t level = log2_q16(energy);
+
+    if (!loudness)
+        loudness = level;
+    else if (level > loudness)
+        loudness += (level - loudness) >> LOUDNESS_ATTACK;
+    else if (level > loudness - LOUDNESS_GATE)
+        loudness += (level - loudness) >> LOUDNESS_RELEASE;
+
+    int32_t goal = loudness_target - loudness;
+    goal = SAT_PLUS(SAT_MINUS(goal, LOUDNESS_MAX_CUT), LOUDNESS_MAX_BOOST + 1);
+
+    loudness_gain += (goal - loudness_gain) >> LOUDNESS_SMOOTHING;
+
+    /* No louder than the loudest energy a packet can carry, which the fixed point math is sized for */
+    q63_t scaled = (I64(energy) * exp2_q16(loudness_gain)) >> 16;
+    return (scaled > ENERGY_LUT[31]) ? ENERGY_LUT[31] : (scaled ? scaled : 1);
+}
+
+/* Samples codec2_decode writes per packet at the current output rate and speed */
+int codec2_samples_per_packet(void)
+{
+    return NUM_FRAMES * frame_samples * output_rate;
+}
+
+static uint32_t fnv1a(uint32_t hash, const uint32_t values[], int count)
+{
+    for (int i = 0; i < count; i++)
+        hash = (hash ^ values[i]) * 16777619u;
+
+    return hash;
+}
+
+/*
+    The settings a decoder state decodes at, together with the global silence floor, transform and
+    excitation kernel, for caches of decoded audio. States with equal keys decode packets to equal
+    samples, except for equaliser curves that differ but hash the same. The equaliser counts by its
+    gains, so a curve changed in place or moved to another buffer is followed. Returns a hash of
+    the key.
+*/
+uint32_t codec2_settings(const codec2_state *state, codec2_settings_key *key)
+{
+    *key = (codec2_settings_key){
+        .rate = state->rate,
+        .frame_samples = state->frame_samples,
+        .pitch_scale = state->pitch_scale,
+        .formant_scale = state->formant_scale,
+        .loudness_target = state->loudness_target,
+        .silence_floor = silence_floor,
+        .fft = fft,
+        .excite = excite,
+        .eq = state->eq ? fnv1a(2166136261u, (const uint32_t *)state->eq, EQ_BINS) | 1 : 0,
+    };
+
+    const uint32_t values[] = {key->rate,           key->frame_samples,   key->pitch_scale,
+                               key->formant_scale,  key->loudness_target, key->silence_floor,
+                               (uintptr_t)key->fft, (uintptr_t)key->excite, key->eq};
+
+    return fnv1a(2166136261u, values, sizeof(values) / sizeof(values[0]));
+}
+
+/* Gain in Q15 that limits the output energy to protect the listener's eardrums, 0 if not needed */
+int ear_protection(int max_amplitude)
+{
+    if (max_amplitude <= LIMIT_THRESH)
+        return 0;
+
+    int scaling_factor = (LIMIT_THRESH * LIMIT_THRESH) / max_amplitude;
+    return (scaling_factor << Q15BITS) / max_amplitude;
+}
+
+/*
+    Output sample k of the current frame, ear protection applied to Sn[0 .. n - 1] and low-passed.
+    The filter adds the sample one 8 kHz sample later, so it responds the same at every rate
+*/
+static inline int output_sample(int k, int n, int rate, int scale)
+{
+    q31_t sample = Sn[k], next = Sn[k + rate];
+
+    if (scale)
+    {
+        sample = (sample * scale) >> Q15BITS;
+
+        if (k + rate < n)
+            next = (next * scale) >> Q15BITS;
+    }
+
+    return SAT15(sample + (next >> 5));
+}
+
+/* Convert the current frame into the sink format, samples first .. first + n - 1 of the packet */
+static void output_frame(const codec2_sink *sink, int first, int n, int rate, int scale)
+{
+    const int stride = sink->stride;
+
+    switch (sink->format)
+    {
+    case CODEC2_SINK_INT16:
+    {
+        short *out = (short *)sink->buffer + first * stride;
+
+        for (int k = 0; k < n; k++)
+            out[k * stride] = output_sample(k, n, rate, scale);
+        break;
+    }
+
+    case CODEC2_SINK_FLOAT32:
+    {
+        float *out = (float *)sink->buffer + first * stride;
+
+        for (int k = 0; k < n; k++)
+            out[k * stride] = output_sample(k, n, rate, scale) * (1.0f / 32768);
+        break;
+    }
+
+    case CODEC2_SINK_PWM:
+    {
+        uint32_t *out = (uint32_t *)sink->buffer + first * sink->repeat * stride;
+
+        for (int k = 0; k < n; k++)
+        {
+            /* Offset binary, the top bits are the duty cycle */
+            uint32_t duty = (uint32_t)(output_sample(k, n, rate, scale) + 32768) >> (16 - sink->bits);
+            uint32_t word = (duty << sink->shift) | sink->constant;
+
+            for (int r = 0; r < sink->repeat; r++, out += stride)
+                *out = word;
+        }
+        break;
+    }
+    }
+}
+
+/* Scale Wo of a voiced frame by pitch_scale and work out the pitch and harmonics count again */
+/* Wo scaled by percent, kept within the pitch range */
+static q31_t scaled_Wo(q31_t Wo, int percent)
+{
+    Wo = (I64(Wo) * percent) / 100;
+
+    if (Wo < TAU_Q28 / P_MAX)
+        Wo = TAU_Q28 / P_MAX;
+
+    if (Wo > TAU_Q28 / P_MIN)
+        Wo = TAU_Q28 / P_MIN;
+
+    return Wo;
+}
+
+static void shift_pitch(MODEL *model)
+{
+    if (pitch_scale == 100 || !model->voiced)
+        return;
+
+    q31_t Wo = scaled_Wo(model->Wo, pitch_scale);
+
+    model->Wo = Wo;
+    model->pitch = TAU_Q28 / (Wo >> 9);
+    model->L = (PI_Q28 / Wo < MAX_L) ? PI_Q28 / Wo : MAX_L;
+}
+
+/*
+    The envelope sampled at m Wo / formant_scale instead of m Wo moves the formants by formant_scale
+    and leaves the pitch alone. Returns the model lpc_to_amplitudes should sample the envelope with,
+    only Wo and pitch differ, the harmonics count stays so the band powers line up with model.
+    Harmonics pushed past pi get no power.
+*/
+static MODEL *shift_formants(MODEL *model, MODEL *warped)
+{
+    if (formant_scale == 100)
+        return model;
+
+    *warped = *model;
+    warped->Wo = (I64(model->Wo) * 100) / formant_scale;
+    warped->pitch = TAU_Q28 / (warped->Wo >> 9);
+    return warped;
+}
+
+void unpack_and_decode(MODEL model[], codec2_pkt *pkt, q31_t received_lsf[], unsigned char *bits, int is_odd)
 {
     /* Interpret and decode the incoming packet */
-    unpack(bits, pkt, 0);
+    unpack(bits, pkt, is_odd);
 
     /* Decode voicings and update models */
     for (int i = 0; i < 4; i++)
@@ -78,68 +412,489 @@ void unpack_and_decode(MODEL model[], codec2_pkt *pkt, q31_t received_lsf[], uns
     bw_expand_lsps(received_lsf);
 }
 
-void interpolate(MODEL model[], q31_t received_lsf[], q31_t lsf[][LPC_ORD])
+void interpolate(MODEL model[], MODEL *prev, q31_t prev_lsf[], q31_t received_lsf[], q31_t lsf[][LPC_ORD])
 {
     /* We have the values for packet #4, for packets 1-3 we interpolate the values */
     for (int i = 0; i < 3; i++)
     {
-        interpolate_lsp(&lsf[i][0], prev_lsfs, received_lsf, i);
-        interpolate_Wo(&model[i], &prev_model, &model[3], i);
-        interpolate_energy(&model[i], &prev_model, &model[3], i);
+        interpolate_lsp(&lsf[i][0], prev_lsf, received_lsf, i);
+        interpolate_Wo(&model[i], prev, &model[3], i);
+        interpolate_energy(&model[i], prev, &model[3], i);
     }
 }
 
-void codec2_decode(short speech[], unsigned char *bits)
+/*
+    Decode a packet down to the harmonic amplitudes and phases of its 4 frames, silent[] flags the
+    frames under the silence floor. Moves the previous model, LSFs, phase and noise generator on
+    to the next packet, only Sn is left to the synthesis.
+*/
+static void analyse(MODEL model[], int silent[], unsigned char *bits, int is_odd)
 {
-    MODEL model[NUM_FRAMES]; /* Parameters for each of the 4 frames */
-    codec2_pkt pkt;          /* Structure describing the 52-bit packet itself */
+    codec2_pkt pkt; /* Structure describing the 52-bit packet itself */
 
     q31_t lsf[NUM_FRAMES][LPC_ORD] = {0}; /* Line spectral frequencies */
     q31_t lsp[NUM_FRAMES][LPC_ORD];       /* Line spectral pairs */
     q31_t lpc[NUM_FRAMES][LPC_ORD + 1];   /* Linear prediction coefficients */
 
     /* Move data received to appropriate memory structs */
-    unpack_and_decode(model, &pkt, &lsf[3][0], bits);
+    unpack_and_decode(model, &pkt, &lsf[3][0], bits, is_odd);
 
     /* We have all values for frame 4, the rest we interpolate */
-    interpolate(model, &lsf[3][0], lsf);
+    interpolate(model, &prev_model, prev_lsfs, &lsf[3][0], lsf);
 
-    q31_t amplitudes[FFT_SIZE * 2] = {0};
+    /* The next packet interpolates from the pitch received, not the shifted one. L stays shifted,
+       it is how many amplitudes a frame copied from prev_model uses */
+    const q31_t received_Wo = model[3].Wo, received_pitch = model[3].pitch;
 
-    /* Process each frame, from initial values down to time domain samples */
+    uint64_t band_power[MAX_L + 1];      /* Post filtered power of each harmonic band */
+    q31_t response[2 * (MAX_L + 1)];    /* LPC filter response at each harmonic */
+
+    /* Analysis, from initial values down to harmonic amplitudes and phases. The forward
+       transforms only depend on the interpolated LSPs, so they run back to back */
     for (int i = 0; i < NUM_FRAMES; i++)
     {
-        /* Line spectral frequencies to line spectral pairs, Q27 -> Q23 */
-        lsf_to_lsp(&lsf[i][0], &lsp[i][0]);
+        shift_pitch(&model[i]);
 
-        /* Convert line spectral pairs to linear prediction coefficients */
-        lsp_to_lpc(&lsp[i][0], &lpc[i][0]);
+        /* Too quiet to bother, only keep the phase and noise generator going so the next voiced
+           frame lines up. Zero amplitudes make the next frame's smoothing fade in from here */
+        silent[i] = model[i].energy < silence_floor;
 
-        /* Convert LPC indexes to frequency domain amplitudes */
-        lpc_to_amplitudes(&fft, &lpc[i][0], &model[i], model[i].energy, amplitudes, pkt.e_index);
+        if (silent[i])
+        {
+            for (int m = 1; m <= model[i].L; m++)
+                model[i].A[m] = 0;
 
-        /* Correct LPC coefficient */
-        apply_lpc_correction(&model[i]);
+            phase_skip(&model[i], &prev_phase, frame_samples);
+            continue;
+        }
 
-        /* Generate excitation and apply filter with the LPC coefficients */
-        phase_synth(&model[i], &prev_phase, amplitudes);
+        MODEL warped;
+        MODEL *envelope = shift_formants(&model[i], &warped);
+
+        /* Same LSFs at the same pitch give the same spectral envelope, skip it if cached */
+        if (!lpc_cache_lookup(fft, &lsf[i][0], envelope, band_power, response))
+        {
+            /* Line spectral frequencies to line spectral pairs, Q27 -> Q23 */
+            lsf_to_lsp(&lsf[i][0], &lsp[i][0]);
+
+            /* Convert line spectral pairs to linear prediction coefficients */
+            lsp_to_lpc(&lsp[i][0], &lpc[i][0]);
+
+            /* Convert LPC coefficients to frequency domain band powers */
+            lpc_to_amplitudes(fft, &lpc[i][0], envelope, band_power, response);
 
-        /* Calculate real and imag parts of the freq domain spectrum, call inverse FFT to get time domain */
-        int max_amplitude = synthesise(&inverse_fft, Sn, &model[i], synthesis_window);
+            lpc_cache_store(fft, &lsf[i][0], envelope, band_power, response);
+        }
 
-        /* Limit output energy to protect the listener's eardrums */
-        ear_protection(Sn, max_amplitude);
+        /* Bands of the warped envelope are formant_scale narrower, make up for the power they lose */
+        if (envelope != &model[i])
+            for (int m = 1; m <= model[i].L; m++)
+                band_power[m] = (band_power[m] * formant_scale) / 100;
 
-        /* Update the output buffer, applying a simple low-pass filter */
-        short *speech_target = &speech[N_SPF * i];
+        /* Scale by the frame energy to get the harmonic amplitudes. The energy carried to the next
+           packet stays the one received */
+        scale_amplitudes(&model[i], normalise_loudness(model[i].energy), band_power);
 
-        for (int k = 0; k < N_SPF; k++)
-            speech_target[k] = SAT15(Sn[k] + (Sn[k + 1] >> 5));
+        /* Correct LPC coefficient */
+        apply_lpc_correction(&model[i]);
+
+        /* Generate excitation and apply filter with the LPC coefficients */
+        phase_synth(excite, &model[i], &prev_phase, response, frame_samples);
     }
 
     /* Keep track of previous values so we can do frame value interpolation */
     prev_model = model[3];
+    prev_model.Wo = received_Wo;
+    prev_model.pitch = received_pitch;
 
     for (int i = 0; i < LPC_ORD; i++)
         prev_lsfs[i] = lsf[3][i];
 }
+
+static void decode(const codec2_sink *sink, unsigned char *bits, int is_odd)
+{
+    MODEL model[NUM_FRAMES];                           /* Parameters for each of the 4 frames */
+    int silent[NUM_FRAMES];                            /* Frames under the silence floor */
+    q31_t frames[NUM_FRAMES][2 * MAX_N_SPF * MAX_RATE]; /* Windowed synthesis output of each frame */
+
+    /* Amplitudes above L are never set but are smoothed against, through prev_model */
+    memset(model, 0, sizeof(model));
+    analyse(model, silent, bits, is_odd);
+
+    /* Calculate real and imag parts of the freq domain spectrum, call inverse FFT to get time domain.
+       The inverse transforms are independent of each other until the overlap-add below */
+    for (int i = 0; i < NUM_FRAMES; i++)
+    {
+        /* Silent frames still go through the overlap-add below, so the tail of the previous
+           frame decays through the window instead of being cut off */
+        if (silent[i])
+            memset(&frames[i][0], 0, 2 * frame_samples * output_rate * sizeof(q31_t));
+        else
+            synthesise(fft, &frames[i][0], &model[i], synthesis_window, eq_curve, frame_samples, output_rate);
+    }
+
+    const int n = frame_samples * output_rate;
+
+    for (int i = 0; i < NUM_FRAMES; i++)
+    {
+        int max_amplitude = overlap_add(Sn, &frames[i][0], n);
+
+        /* Ear protection, a simple low-pass filter and the conversion to the sink format in one go */
+        output_frame(sink, n * i, n, output_rate, ear_protection(max_amplitude));
+    }
+}
+
+void codec2_decode(short speech[], unsigned char *bits)
+{
+    codec2_sink sink = {.format = CODEC2_SINK_INT16, .buffer = speech, .stride = 1};
+
+    decode(&sink, bits, 0);
+}
+
+/* Decode the second packet of a dense 13 byte pair, bits points at byte 6 of the pair */
+void codec2_decode_odd(short speech[], unsigned char *bits)
+{
+    codec2_sink sink = {.format = CODEC2_SINK_INT16, .buffer = speech, .stride = 1};
+
+    decode(&sink, bits, 1);
+}
+
+/* Decode a packet straight into the format of the sink, see codec2_sink */
+void codec2_decode_to(const codec2_sink *sink, unsigned char *bits)
+{
+    decode(sink, bits, 0);
+}
+
+/* Power-on state of the decoder, what codec2_init and the initialisers above leave behind, at the
+   current output rate and speed */
+void codec2_default_state(codec2_state *state)
+{
+    state->prev_model = (MODEL){.Wo = TAU_Q28 / P_MAX, .pitch = MAX_PITCH, .L = MAX_L, .energy = ONE_IN_Q12};
+    state->prev_phase = 0;
+    state->lfsr = LFSR_SEED;
+    state->rate = output_rate;
+    state->frame_samples = frame_samples;
+    state->pitch_scale = pitch_scale;
+    state->formant_scale = formant_scale;
+    state->eq = eq_curve;
+    state->loudness_target = loudness_target;
+    state->loudness = 0;
+    state->loudness_gain = 0;
+
+    for (int i = 0; i < LPC_ORD; i++)
+        state->prev_lsfs[i] = i * (TAU_Q26 / (LPC_ORD + 1));
+
+    for (int i = 0; i < 2 * MAX_N_SPF * MAX_RATE; i++)
+        state->Sn[i] = 0;
+}
+
+/* The state without Sn, what analyse works on */
+static void save_parameters(codec2_state *state)
+{
+    state->prev_model = prev_model;
+    state->prev_phase = prev_phase;
+    state->lfsr = lfsr;
+    state->rate = output_rate;
+    state->frame_samples = frame_samples;
+    state->pitch_scale = pitch_scale;
+    state->formant_scale = formant_scale;
+    state->eq = eq_curve;
+    state->loudness_target = loudness_target;
+    state->loudness = loudness;
+    state->loudness_gain = loudness_gain;
+    memcpy(state->prev_lsfs, prev_lsfs, sizeof(prev_lsfs));
+}
+
+static void load_parameters(const codec2_state *state)
+{
+    prev_model = state->prev_model;
+    prev_phase = state->prev_phase;
+    lfsr = state->lfsr;
+    output_rate = state->rate;
+    frame_samples = state->frame_samples;
+    pitch_scale = state->pitch_scale;
+    formant_scale = state->formant_scale;
+    eq_curve = state->eq;
+    loudness_target = state->loudness_target;
+    loudness = state->loudness;
+    loudness_gain = state->loudness_gain;
+    memcpy(prev_lsfs, state->prev_lsfs, sizeof(prev_lsfs));
+}
+
+/* Swap the decoder state out and back in, so one decoder can serve several streams */
+void codec2_save_state(codec2_state *state)
+{
+    save_parameters(state);
+
+    /* Only the samples in use at this rate and speed */
+    memcpy(state->Sn, Sn, 2 * frame_samples * output_rate * sizeof(q31_t));
+}
+
+void codec2_load_state(const codec2_state *state)
+{
+    load_parameters(state);
+    memcpy(Sn, state->Sn, 2 * frame_samples * output_rate * sizeof(q31_t));
+}
+
+/*
+    Mix a packet (7 bytes) of each of count talkers into one stream, for a conference bridge.
+    Synthesis is linear, so the harmonics of all talkers go into one spectrum per frame, scaled by
+    gains[] (Q16, NULL for all 1.0), and take one inverse transform and one overlap-add whatever
+    the number of talkers. Each talker's own settings apply up to its amplitudes (speed excepted,
+    talkers run at the rate and speed of mix), the equaliser is mix's.
+
+    The overlap of the sum is kept in mix->Sn, the talkers' Sn are left alone: a talker taken out
+    of the mix starts its own overlap from what it had before. The summed spectra live in work,
+    which needs no setup and can be shared by calls that do not run at the same time. Leaves the
+    decoder in mix's state. Returns 0 or -1 if a talker's rate or speed differ from mix's.
+*/
+int codec2_mix(codec2_state *mix, codec2_mix_workspace *work, codec2_state *talkers[], unsigned char *bits[],
+               const q31_t gains[], int count, const codec2_sink *sink)
+{
+    MODEL model[NUM_FRAMES];
+    int silent[NUM_FRAMES], active[NUM_FRAMES] = {0};
+
+    for (int t = 0; t < count; t++)
+        if (talkers[t]->rate != mix->rate || talkers[t]->frame_samples != mix->frame_samples)
+            return -1;
+
+    memset(work->Sw_, 0, sizeof(work->Sw_));
+
+    for (int t = 0; t < count; t++)
+    {
+        /* Nothing of the previous talker may leak into the amplitude smoothing */
+        memset(model, 0, sizeof(model));
+
+        load_parameters(talkers[t]);
+        analyse(model, silent, bits[t], 0);
+        save_parameters(talkers[t]);
+
+        for (int i = 0; i < NUM_FRAMES; i++)
+        {
+            if (silent[i])
+                continue;
+
+            if (gains)
+                for (int m = 1; m <= model[i].L; m++)
+                    model[i].A[m] = SAT((I64(model[i].A[m]) * gains[t]) >> 16);
+
+            freq_domain_calc(&work->Sw_[i][0], &model[i], mix->eq);
+            active[i] = 1;
+        }
+    }
+
+    codec2_load_state(mix);
+
+    const int n = frame_samples * output_rate;
+
+    /* One frame buffer does, each frame is added to the overlap before the next is synthesised */
+    for (int i = 0; i < NUM_FRAMES; i++)
+    {
+        if (active[i])
+            synthesise_spectrum(fft, work->frame, &work->Sw_[i][0], synthesis_window, frame_samples, output_rate);
+        else
+            memset(work->frame, 0, 2 * n * sizeof(q31_t));
+
+        int max_amplitude = overlap_add(Sn, work->frame, n);
+
+        /* The limiter sees the sum, so loud moments of several talkers do not clip */
+        output_frame(sink, n * i, n, output_rate, ear_protection(max_amplitude));
+    }
+
+    codec2_save_state(mix);
+    return 0;
+}
+
+static uint8_t *put32(uint8_t *out, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        *out++ = value >> (8 * i);
+
+    return out;
+}
+
+static const uint8_t *get32(const uint8_t *in, int32_t *value)
+{
+    *value = (int32_t)(in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24));
+    return in + 4;
+}
+
+/*
+    Write a decoder state to out[] (at most CODEC2_STATE_BYTES), in a layout that does not
+    depend on the host, so a stream can carry on decoding in another process or on another
+    machine. Only what the next packet reads is kept: the scalars and the L + 1 amplitudes
+    of the previous model, the previous LSFs, the phase, the noise generator and the part of
+    Sn the next overlap-add starts from. Returns the number of bytes written.
+
+        byte 0        CODEC2_STATE_VERSION
+        byte 1        L
+        byte 2        voiced
+        byte 3        output rate, in samples per 8 kHz sample
+        byte 4        samples per frame at 8 kHz, set by the speed
+        byte 5, 6     pitch and formant scale in percent
+        then, as little endian 32 bit words: Wo, pitch, energy, A[0 .. L], the LPC_ORD
+        previous LSFs, the phase, the noise generator, the loudness target, loudness and gain
+        and Sn[n .. 2 * n - 1], n being the samples per frame times the rate
+*/
+int codec2_state_write(const codec2_state *state, uint8_t out[])
+{
+    const MODEL *model = &state->prev_model;
+    uint8_t *end = out;
+
+    *end++ = CODEC2_STATE_VERSION;
+    *end++ = model->L;
+    *end++ = model->voiced;
+    *end++ = state->rate;
+    *end++ = state->frame_samples;
+    *end++ = state->pitch_scale;
+    *end++ = state->formant_scale;
+
+    end = put32(end, model->Wo);
+    end = put32(end, model->pitch);
+    end = put32(end, model->energy);
+
+    for (int m = 0; m <= model->L; m++)
+        end = put32(end, model->A[m]);
+
+    for (int i = 0; i < LPC_ORD; i++)
+        end = put32(end, state->prev_lsfs[i]);
+
+    end = put32(end, state->prev_phase);
+    end = put32(end, state->lfsr);
+    end = put32(end, state->loudness_target);
+    end = put32(end, state->loudness);
+    end = put32(end, state->loudness_gain);
+
+    for (int i = state->frame_samples * state->rate; i < 2 * state->frame_samples * state->rate; i++)
+        end = put32(end, state->Sn[i]);
+
+    return end - out;
+}
+
+/* Read a state written by codec2_state_write, returns 0 or -1 if it is not a valid state */
+int codec2_state_read(codec2_state *state, const uint8_t in[], size_t size)
+{
+    if (size < 7 || in[0] != CODEC2_STATE_VERSION || in[1] > MAX_L || in[2] > 1 || in[3] < 1 || in[3] > MAX_RATE ||
+        in[4] < MIN_N_SPF || in[4] > MAX_N_SPF || in[5] < MIN_VOICE_SCALE || in[5] > MAX_VOICE_SCALE ||
+        in[6] < MIN_VOICE_SCALE || in[6] > MAX_VOICE_SCALE ||
+        size != (size_t)7 + 4 * (3 + in[1] + 1 + LPC_ORD + 5 + in[4] * in[3]))
+        return -1;
+
+    codec2_default_state(state);
+
+    MODEL *model = &state->prev_model;
+    int32_t value;
+
+    model->L = in[1];
+    model->voiced = in[2];
+    state->rate = in[3];
+    state->frame_samples = in[4];
+    state->pitch_scale = in[5];
+    state->formant_scale = in[6];
+    in += 7;
+
+    in = get32(in, &model->Wo);
+    in = get32(in, &model->pitch);
+    in = get32(in, &model->energy);
+
+    /* The synthesis divides by Wo and places harmonics by it, so only what unpack and the pitch
+       shift produce gets through */
+    if (model->Wo < TAU_Q28 / P_MAX || model->Wo > TAU_Q28 / P_MIN || model->pitch < (P_MIN << 9) ||
+        model->pitch > MAX_PITCH || model->energy < 1 || model->energy > ENERGY_LUT[31])
+        return -1;
+
+    /* A voiced frame keeps the Wo received, interpolating from it must not leave the table, and the
+       L it keeps is the one shift_pitch gives that Wo. Frames copied from it rely on both */
+    if (model->voiced)
+    {
+        const q31_t Wo = scaled_Wo(model->Wo, state->pitch_scale);
+
+        if (model->Wo < Wo_LUT[0] || model->L != ((PI_Q28 / Wo < MAX_L) ? PI_Q28 / Wo : MAX_L))
+            return -1;
+    }
+
+    for (int m = 0; m <= model->L; m++)
+    {
+        in = get32(in, &model->A[m]);
+
+        if (model->A[m] < 0)
+            return -1;
+    }
+
+    /* Angles from 0 to pi, in Q27 */
+    for (int i = 0; i < LPC_ORD; i++)
+    {
+        in = get32(in, &state->prev_lsfs[i]);
+
+        if (state->prev_lsfs[i] < 0 || state->prev_lsfs[i] > TAU_Q26)
+            return -1;
+    }
+
+    in = get32(in, &state->prev_phase);
+    in = get32(in, &value);
+    state->lfsr = value;
+    in = get32(in, &state->loudness_target);
+    in = get32(in, &state->loudness);
+    in = get32(in, &state->loudness_gain);
+
+    /* Levels are log2 of frame energies, their difference has to fit in 32 bits */
+    const int32_t loudest = log2_q16(ENERGY_LUT[31]);
+
+    if (state->loudness_target < 0 || state->loudness_target > loudest || state->loudness < 0 ||
+        state->loudness > loudest || state->loudness_gain < -LOUDNESS_MAX_CUT ||
+        state->loudness_gain > LOUDNESS_MAX_BOOST)
+        return -1;
+
+    for (int i = state->frame_samples * state->rate; i < 2 * state->frame_samples * state->rate; i++)
+        in = get32(in, &state->Sn[i]);
+
+    return 0;
+}
+
+/*
+    Run the decoder over n packets (7 bytes each) without producing audio, for seeking and
+    muted channels. Only what the next packet depends on is kept up to date: the previous
+    model and LSFs, the phase and the noise generator. The overlap state in Sn only depends
+    on the last frame, so just the final packet is decoded in full and its audio dropped.
+*/
+void codec2_advance(unsigned char *bits, int n)
+{
+    MODEL model[NUM_FRAMES];
+    codec2_pkt pkt;
+
+    q31_t lsf[NUM_FRAMES][LPC_ORD] = {0};
+    short speech[NUM_FRAMES * MAX_N_SPF * MAX_RATE];
+
+    if (n <= 0)
+        return;
+
+    /* The amplitudes are never computed here, so prev_model gets zeros rather than stack garbage */
+    memset(model, 0, sizeof(model));
+
+    for (; n > 1; n--, bits += 7)
+    {
+        unpack_and_decode(model, &pkt, &lsf[3][0], bits, 0);
+        interpolate(model, &prev_model, prev_lsfs, &lsf[3][0], lsf);
+
+        /* The phase moves on at the shifted pitch and the loudness is tracked, like when decoding */
+        const q31_t received_Wo = model[3].Wo, received_pitch = model[3].pitch;
+
+        for (int i = 0; i < NUM_FRAMES; i++)
+        {
+            shift_pitch(&model[i]);
+            phase_skip(&model[i], &prev_phase, frame_samples);
+
+            if (model[i].energy >= silence_floor)
+                normalise_loudness(model[i].energy);
+        }
+
+        prev_model = model[3];
+        prev_model.Wo = received_Wo;
+        prev_model.pitch = received_pitch;
+
+        for (int i = 0; i < LPC_ORD; i++)
+            prev_lsfs[i] = lsf[3][i];
+    }
+
+    codec2_decode(speech, bits);
+}
@@ -38,21 +38,27 @@ GPIO 1 --------------/------o   Ring
 */
 
 //////////////////////// EVIL GLOBAL VARIABLES ////////////////////////
-uint32_t audio_buffer[REPETITION_RATE * AUDIO_SAMPLES] = {0};
-static volatile int write_done = 0;
+uint32_t audio_buffer[2][REPETITION_RATE * AUDIO_SAMPLES] = {0};
+static volatile int playing = 0, write_done = 0;
 int dma_channel;
 
 //////////////////////// IRQ HANDLER ROUTINE /////////////////////////
 void dma_irq_handler()
 {
+    /* Switch to the buffer that was decoded into meanwhile */
+    playing ^= 1;
     write_done = 1;
-    dma_hw->ch[dma_channel].al3_read_addr_trig = (uintptr_t)audio_buffer;
+    dma_hw->ch[dma_channel].al3_read_addr_trig = (uintptr_t)audio_buffer[playing];
     dma_hw->ints0 = (1u << dma_channel);
 }
 
 int main(int argc, char *argv[])
 {
-    short int buffer[640];
+    /* The decoder writes PWM compare values straight into the audio buffer: the top 12 bits of
+       each sample in channel A, REPETITION_RATE times. Channel B is fixed in the middle (0x7ff)
+       with opposing polarity to reduce noise a bit */
+    codec2_sink sink = {
+        .format = CODEC2_SINK_PWM, .stride = 1, .bits = 12, .shift = 16, .constant = 0x7ff, .repeat = REPETITION_RATE};
 
     set_sys_clock_khz(131000, true);
     stdio_init_all();
@@ -104,7 +110,7 @@ int main(int argc, char *argv[])
     dma_channel_configure(dma_channel,                        // DMA channel
                           &dma_channel_config,                // Channel config
                           &pwm_hw->slice[audio_pin_slice].cc, // We write to the compare counter
-                          audio_buffer,                       // We read from audio_buffer
+                          audio_buffer[playing],              // We read from audio_buffer
                           REPETITION_RATE * AUDIO_SAMPLES,    // Will write number of samples x sample repeat
                           false                               // Don't auto-start immediately
     );
@@ -119,24 +125,9 @@ int main(int argc, char *argv[])
     {
         for (int i = 0; i < coded_data_len; i += 7) // For each decoded codec2 packet
         {
-            for (int j = 0; j < AUDIO_SAMPLES; j++) // write samples to the audio buffer
-            {
-                uint32_t sample = (uint32_t)(((int32_t)buffer[j]) + 32768);
-                uint32_t low, high;
-
-                high = (sample >> 4) & 0xfff;
-
-                /* Fix channel B in the middle (to 0x7ff) and make its
-                   PWM opposing polarity to reduce noise a bit */
-                sample = (high << 16) | 0x7ff;
-
-                audio_buffer[4 * j + 0] = sample;
-                audio_buffer[4 * j + 1] = sample;
-                audio_buffer[4 * j + 2] = sample;
-                audio_buffer[4 * j + 3] = sample;
-            }
-
-            codec2_decode(buffer, &coded_data[i]); // Decode new packet while DMA is playing
+            // Decode the next packet into the buffer the DMA is not playing
+            sink.buffer = audio_buffer[playing ^ 1];
+            codec2_decode_to(&sink, &coded_data[i]);
 
             // After finishing decode, wait until DMA reaches end of audio buffer
             while (!write_done)
@@ -0,0 +1,113 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "dsp/transform_functions.h"
+#include "fxpmath.h"
+
+void arm_split_rifft_q31(q31_t *pSrc, uint32_t fftLen, const q31_t *pATable, const q31_t *pBTable, q31_t *pDst,
+                         uint32_t modifier);
+
+/*
+    Real FFT split step, equivalent to arm_split_rfft_q31 but reading the complex FFT output z
+    through order[] instead of expecting it sorted. Both fixed point engines leave their output
+    in bit-reversed order, this way it never has to be sorted. Only the non-negative frequencies
+    0 .. FFT_SIZE / 2 are written to dst.
+*/
+void rfft_split(const q31_t z[], const uint8_t order[], q31_t dst[])
+{
+    const arm_rfft_instance_q31 *fft = &rfft_512;
+
+    for (int i = 1; i < HALF_FFT_SIZE; i++)
+    {
+        const q31_t *in1 = &z[2 * order[i]];
+        const q31_t *in2 = &z[2 * order[HALF_FFT_SIZE - i]];
+
+        q31_t coef_a1 = fft->pTwiddleAReal[2 * i];
+        q31_t coef_a2 = fft->pTwiddleAReal[2 * i + 1];
+        q31_t coef_b1 = fft->pTwiddleBReal[2 * i];
+        q31_t re, im;
+
+        /* Same operations in the same order as arm_split_rfft_q31, so rounding is identical */
+        mult_32x32_keep32_R(re, in1[0], coef_a1);
+        mult_32x32_keep32_R(im, in1[0], coef_a2);
+        multSub_32x32_keep32_R(re, in1[1], coef_a2);
+        multAcc_32x32_keep32_R(im, in1[1], coef_a1);
+        multSub_32x32_keep32_R(re, in2[1], coef_a2);
+        multSub_32x32_keep32_R(im, in2[1], coef_b1);
+        multAcc_32x32_keep32_R(re, in2[0], coef_b1);
+        multSub_32x32_keep32_R(im, in2[0], coef_a2);
+
+        dst[2 * i] = re;
+        dst[2 * i + 1] = im;
+    }
+
+    dst[2 * HALF_FFT_SIZE] = (z[0] - z[1]) >> 1;
+    dst[2 * HALF_FFT_SIZE + 1] = 0;
+
+    dst[0] = (z[0] + z[1]) >> 1;
+    dst[1] = 0;
+}
+
+/* Real inverse FFT first half, turns FFT_SIZE / 2 + 1 bins into the complex FFT input */
+void irfft_split(q31_t src[], q31_t z[])
+{
+    const arm_rfft_instance_q31 *fft = &irfft_512;
+
+    arm_split_rifft_q31(src, HALF_FFT_SIZE, fft->pTwiddleAReal, fft->pTwiddleBReal, z, fft->twidCoefRModifier);
+}
+
+/*
+    Copy time samples first .. first + count - 1 (wrapping around FFT_SIZE) out of the complex
+    inverse FFT output z, stored in order[]. The real samples are interleaved as re/im pairs.
+    Also applies the one bit upscale arm_rfft_q31 does with arm_shift_q31, and negates the
+    odd samples if the engine computed the inverse as a conjugated forward transform.
+*/
+void irfft_gather(const q31_t z[], const uint8_t order[], int conjugate, q31_t dst[], int first, int count)
+{
+    for (int i = 0, n = first; i < count; i++, n = (n + 1) & (FFT_SIZE - 1))
+    {
+        q63_t sample = z[2 * order[n >> 1] + (n & 1)];
+
+        if (conjugate && (n & 1))
+            sample = -sample;
+
+        dst[i] = SAT(sample << 1);
+    }
+}
+
+static void cmsis_forward(q31_t src[], q31_t dst[])
+{
+    /* The complex FFT output stays in bit-reversed order, rfft_split sorts it out */
+    arm_cfft_q31(rfft_512.pCfft, src, 0, 0);
+    rfft_split(src, bitrev_256, dst);
+}
+
+static void cmsis_inverse(q31_t src[], q31_t dst[], int first, int count)
+{
+    q31_t z[FFT_SIZE];
+
+    irfft_split(src, z);
+    arm_cfft_q31(irfft_512.pCfft, z, 1, 0);
+
+    /* Synthesis only needs a few of the FFT_SIZE samples, so they are picked straight out of
+       the bit-reversed output instead of sorting (and upscaling) all of it */
+    irfft_gather(z, bitrev_256, 0, dst, first, count);
+}
+
+/* The vendored CMSIS radix-4 q31 transform */
+const fft_engine fft_cmsis = {
+    .name = "cmsis-q31",
+    .scale = 9,
+    .forward = cmsis_forward,
+    .inverse = cmsis_inverse,
+};
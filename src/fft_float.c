@@ -0,0 +1,132 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <math.h>
+#include <pthread.h>
+
+/* Twiddles exp(-j 2 pi k / FFT_SIZE), filled in on first use by whichever thread gets there first */
+static float twiddle_re[FFT_SIZE / 2], twiddle_im[FFT_SIZE / 2];
+static pthread_once_t twiddles_once = PTHREAD_ONCE_INIT;
+
+static void init_twiddles(void)
+{
+    for (int k = 0; k < FFT_SIZE / 2; k++)
+    {
+        twiddle_re[k] = cosf(2 * (float)M_PI * k / FFT_SIZE);
+        twiddle_im[k] = -sinf(2 * (float)M_PI * k / FFT_SIZE);
+    }
+}
+
+/* In-place radix-2 FFT of FFT_SIZE complex values, inverse if sign is negative (unnormalised) */
+static void fft_radix2(float re[], float im[], int sign)
+{
+    pthread_once(&twiddles_once, init_twiddles);
+
+    for (int i = 1, j = 0; i < FFT_SIZE; i++)
+    {
+        int bit = FFT_SIZE >> 1;
+
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+
+        j |= bit;
+
+        if (i < j)
+        {
+            float t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (int len = 2; len <= FFT_SIZE; len <<= 1)
+    {
+        int stride = FFT_SIZE / len;
+
+        for (int i = 0; i < FFT_SIZE; i += len)
+        {
+            for (int k = 0; k < len / 2; k++)
+            {
+                float w_re = twiddle_re[k * stride], w_im = sign * twiddle_im[k * stride];
+                int a = i + k, b = i + k + len / 2;
+
+                float t_re = re[b] * w_re - im[b] * w_im;
+                float t_im = re[b] * w_im + im[b] * w_re;
+
+                re[b] = re[a] - t_re;
+                im[b] = im[a] - t_im;
+                re[a] += t_re;
+                im[a] += t_im;
+            }
+        }
+    }
+}
+
+static q31_t to_q31(float value)
+{
+    return (q31_t)SAT(llrintf(value));
+}
+
+static void float_forward(q31_t src[], q31_t dst[])
+{
+    float re[FFT_SIZE], im[FFT_SIZE] = {0};
+
+    for (int i = 0; i < FFT_SIZE; i++)
+        re[i] = src[i];
+
+    fft_radix2(re, im, 1);
+
+    /* Same scaling as the fixed point engines, 1 / FFT_SIZE */
+    for (int k = 0; k <= FFT_SIZE / 2; k++)
+    {
+        dst[2 * k] = to_q31(re[k] / FFT_SIZE);
+        dst[2 * k + 1] = to_q31(im[k] / FFT_SIZE);
+    }
+}
+
+static void float_inverse(q31_t src[], q31_t dst[], int first, int count)
+{
+    float re[FFT_SIZE], im[FFT_SIZE];
+
+    /* Rebuild the negative frequencies from the conjugate symmetry of a real signal */
+    for (int k = 0; k <= FFT_SIZE / 2; k++)
+    {
+        re[k] = src[2 * k];
+        im[k] = src[2 * k + 1];
+
+        if (k > 0 && k < FFT_SIZE / 2)
+        {
+            re[FFT_SIZE - k] = re[k];
+            im[FFT_SIZE - k] = -im[k];
+        }
+    }
+
+    fft_radix2(re, im, -1);
+
+    for (int i = 0, n = first; i < count; i++, n = (n + 1) & (FFT_SIZE - 1))
+        dst[i] = to_q31(re[n] / FFT_SIZE);
+}
+
+/* Floating point transform for hosts with an FPU, used to check the fixed point ones against */
+const fft_engine fft_float = {
+    .name = "float",
+    .scale = 9,
+    .forward = float_forward,
+    .inverse = float_inverse,
+};
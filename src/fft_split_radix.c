@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "dsp/transform_functions.h"
+#include "fxpmath.h"
+
+/*
+    In-place split-radix decimation in frequency, x holds n complex values.
+
+    The even bins are computed by a half size transform stored in the first half, the 4k + 1
+    and 4k + 3 bins by two quarter size transforms in the remaining quarters. This ends up
+    in plain bit-reversed order, just like the CMSIS transform.
+
+    To match the CMSIS scaling of 1/n, the half size branch is scaled by 1/2 and the quarter
+    size branches (which skip a level) by 1/4. twiddle_stride maps the size n twiddles onto
+    the HALF_FFT_SIZE table of (cos, sin) pairs.
+*/
+static void split_radix(q31_t x[], int n, int twiddle_stride)
+{
+    if (n == 1)
+        return;
+
+    if (n == 2)
+    {
+        q31_t re = x[0] >> 1, im = x[1] >> 1;
+
+        x[0] = re + (x[2] >> 1);
+        x[1] = im + (x[3] >> 1);
+        x[2] = re - (x[2] >> 1);
+        x[3] = im - (x[3] >> 1);
+        return;
+    }
+
+    const int quarter = n >> 2;
+    const q31_t *twiddle = cfft_256.pTwiddle;
+
+    for (int k = 0; k < quarter; k++)
+    {
+        q31_t *a = &x[2 * k], *b = &x[2 * (k + quarter)];
+        q31_t *c = &x[2 * (k + 2 * quarter)], *d = &x[2 * (k + 3 * quarter)];
+
+        /* r1 = a - c, r2 = b - d, both scaled by 1/4 */
+        q31_t r1_re = (a[0] >> 2) - (c[0] >> 2), r1_im = (a[1] >> 2) - (c[1] >> 2);
+        q31_t r2_re = (b[0] >> 2) - (d[0] >> 2), r2_im = (b[1] >> 2) - (d[1] >> 2);
+
+        /* Even bins, (a + c) and (b + d) scaled by 1/2 */
+        a[0] = (a[0] >> 1) + (c[0] >> 1);
+        a[1] = (a[1] >> 1) + (c[1] >> 1);
+        b[0] = (b[0] >> 1) + (d[0] >> 1);
+        b[1] = (b[1] >> 1) + (d[1] >> 1);
+
+        /* 4k + 1 bins, (r1 - j r2) * exp(-j 2 pi k / n) */
+        q31_t re = r1_re + r2_im, im = r1_im - r2_re;
+        q31_t cos = twiddle[2 * k * twiddle_stride], sin = twiddle[2 * k * twiddle_stride + 1];
+
+        c[0] = MUL(re, cos) + MUL(im, sin);
+        c[1] = MUL(im, cos) - MUL(re, sin);
+
+        /* 4k + 3 bins, (r1 + j r2) * exp(-j 6 pi k / n) */
+        re = r1_re - r2_im;
+        im = r1_im + r2_re;
+        cos = twiddle[6 * k * twiddle_stride];
+        sin = twiddle[6 * k * twiddle_stride + 1];
+
+        d[0] = MUL(re, cos) + MUL(im, sin);
+        d[1] = MUL(im, cos) - MUL(re, sin);
+    }
+
+    split_radix(x, n >> 1, twiddle_stride << 1);
+    split_radix(&x[n], quarter, twiddle_stride << 2);
+    split_radix(&x[n + (n >> 1)], quarter, twiddle_stride << 2);
+}
+
+static void split_radix_forward(q31_t src[], q31_t dst[])
+{
+    split_radix(src, HALF_FFT_SIZE, 1);
+    rfft_split(src, bitrev_256, dst);
+}
+
+static void split_radix_inverse(q31_t src[], q31_t dst[], int first, int count)
+{
+    q31_t z[FFT_SIZE];
+
+    irfft_split(src, z);
+
+    /* The inverse transform is the conjugate of the forward transform of the conjugate,
+       irfft_gather takes care of conjugating the output */
+    for (int i = 1; i < FFT_SIZE; i += 2)
+        z[i] = -z[i];
+
+    split_radix(z, HALF_FFT_SIZE, 1);
+    irfft_gather(z, bitrev_256, 1, dst, first, count);
+}
+
+/* Split-radix q31 transform, fewer multiplications than radix-4 but recursive */
+const fft_engine fft_split_radix = {
+    .name = "split-radix-q31",
+    .scale = 9,
+    .forward = split_radix_forward,
+    .inverse = split_radix_inverse,
+};
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+/*
+    Wo only takes the 128 values of Wo_LUT and the ones interpolate_Wo produces between them,
+    so the same few layouts keep coming back. The cache is direct-mapped and keyed on the
+    values alone, so it holds no decoder state. A slot taken over by another pitch is simply
+    rebuilt on its next use, which is why callers look the geometry up instead of keeping it.
+*/
+harmonic_geometry geometry_cache[1 << GEOMETRY_CACHE_BITS];
+
+static void build_geometry(harmonic_geometry *g, const MODEL *model)
+{
+    /* Shift to Q18, divide by Q9 -> back to Q9 */
+    const int step = (FFT_SIZE << Q18BITS) / model->pitch;
+
+    /* Band width is twice the start offset, both in Q9 */
+    const int start = (model->Wo / TAU_Q11);
+    const int width = 2 * start;
+
+    for (int m = 0, i = ONE_HALF_IN_Q9, j = start + ONE_HALF_IN_Q9; m <= model->L; m++, i += step, j += width)
+    {
+        int k = (i >> Q9BITS), e = (j >> Q9BITS);
+
+        g->bin[m] = (k >= HALF_FFT_SIZE) ? HALF_FFT_SIZE - 1 : k;
+        g->edge[m] = (e > HALF_FFT_SIZE) ? HALF_FFT_SIZE : e;
+    }
+
+    g->Wo = model->Wo;
+    g->pitch = model->pitch;
+    g->L = model->L;
+}
+
+const harmonic_geometry *get_harmonic_geometry(const MODEL *model)
+{
+    /* Fibonacci hashing, Wo_LUT steps are too regular to use the low bits directly */
+    uint32_t slot = ((uint32_t)model->Wo * 2654435769u) >> (32 - GEOMETRY_CACHE_BITS);
+    harmonic_geometry *g = &geometry_cache[slot];
+
+    if (g->Wo != model->Wo || g->pitch != model->pitch || g->L != model->L)
+        build_geometry(g, model);
+
+    return g;
+}
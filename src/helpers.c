@@ -13,20 +13,6 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 #include "defines.h"
 #include "fxpmath.h"
 
-void complex_multiply(q31_t *a, q31_t *b, q31_t *dst, int len)
-{
-    for (int i = 0; i < len; i++)
-    {
-        q31_t ar = a[2 * i];     /* Real part of a[i]      */
-        q31_t ai = a[2 * i + 1]; /* Imaginary part of a[i] */
-        q31_t br = b[2 * i];     /* Real part of b[i]      */
-        q31_t bi = b[2 * i + 1]; /* Imaginary part of b[i] */
-
-        dst[2 * i] = SUB(MUL(ar, br), MUL(ai, bi));     /* Real part of a[i] * b[i] */
-        dst[2 * i + 1] = ADD(MUL(ar, bi), MUL(ai, br)); /* Imaginary part of a[i] * b[i] */
-    }
-}
-
 void shift_left(q31_t src[], q31_t dst[], int len)
 {
     for (int i = 0; i < len; i++)
@@ -64,6 +50,25 @@ void cordic(int32_t theta, q31_t *sin, q31_t *cos)
     *sin = y;
 }
 
+/* log2(x) in Q16 for x > 0, log2(1 + f) ~ f + 0.3466 f (1 - f), max error 0.005 */
+int32_t log2_q16(uint64_t x)
+{
+    int e = 63 - __builtin_clzll(x);
+    uint32_t f = (e > 16 ? x >> (e - 16) : x << (16 - e)) & 0xffff;
+
+    return (e << 16) + f + (((f * (0x10000 - f)) >> 16) * 22713 >> 16);
+}
+
+/* 2^(y / 2^16) in Q16, 2^f ~ 1 + f - 0.3431 f (1 - f), max error 0.002 */
+uint32_t exp2_q16(int32_t y)
+{
+    int e = y >> 16;
+    uint32_t f = y & 0xffff;
+    uint32_t m = 0x10000 + f - (((f * (0x10000 - f)) >> 16) * 22486 >> 16);
+
+    return (e >= 0) ? m << e : m >> -e;
+}
+
 int decode_gray(int num)
 {
     num ^= num >> 8;
@@ -0,0 +1,359 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    Sidecar index of a recording of packed packets, built once and memory-mapped read-only
+    by any number of readers. The packets are unpacked into columns (voicing, Wo, energy and
+    the 10 LSP indexes) in blocks of INDEX_BLOCK packets, and each block keeps a zone map
+    with the range of every column. Queries skip blocks whose ranges rule them out, or take
+    whole blocks whose ranges guarantee a match, and only decode the columns of the rest.
+
+    File layout, in the host byte order:
+
+        codec2_index_header
+        codec2_zone for every block
+        column data of every block, each column packed LSB first relative to its minimum,
+        with just enough bits for max - min (no bits at all when they are equal), starting
+        on a byte boundary. One padding byte follows the last column of a block.
+*/
+
+#define INDEX_VERSION 1
+
+static int width_of(int range)
+{
+    int width = 0;
+
+    while (range >> width)
+        width++;
+
+    return width;
+}
+
+static int column_bytes(int count, int width)
+{
+    return (count * width + 7) >> 3;
+}
+
+static int block_packets(const codec2_index *index, int block)
+{
+    int left = index->header->packets - block * INDEX_BLOCK;
+    return (left < INDEX_BLOCK) ? left : INDEX_BLOCK;
+}
+
+/* Unpack the columns of one packet, also used by the archive */
+void packet_columns(const unsigned char *bits, uint8_t values[])
+{
+    codec2_pkt pkt;
+
+    unpack((unsigned char *)bits, &pkt, 0);
+
+    values[INDEX_VOICING] = (pkt.voiced[0] << 3) | (pkt.voiced[1] << 2) | (pkt.voiced[2] << 1) | pkt.voiced[3];
+    values[INDEX_WO] = pkt.Wo_index;
+    values[INDEX_ENERGY] = pkt.e_index;
+
+    for (int i = 0; i < LPC_ORD; i++)
+        values[INDEX_LSP + i] = pkt.lsp_indexes[i];
+}
+
+/* Pack one block of count packets, returns the number of bytes written to data */
+static int pack_block(const unsigned char *bits, int count, codec2_zone *zone, uint8_t data[])
+{
+    uint8_t values[INDEX_BLOCK][INDEX_COLUMNS];
+    int size = 0;
+
+    memset(zone->min, 0xff, sizeof(zone->min));
+    memset(zone->max, 0, sizeof(zone->max));
+    zone->voiced = 0;
+
+    for (int k = 0; k < count; k++, bits += 7)
+    {
+        packet_columns(bits, values[k]);
+
+        for (int c = 0; c < INDEX_COLUMNS; c++)
+        {
+            if (values[k][c] < zone->min[c])
+                zone->min[c] = values[k][c];
+
+            if (values[k][c] > zone->max[c])
+                zone->max[c] = values[k][c];
+        }
+
+        zone->voiced += __builtin_popcount(values[k][INDEX_VOICING]);
+    }
+
+    for (int c = 0; c < INDEX_COLUMNS; c++)
+    {
+        int width = width_of(zone->max[c] - zone->min[c]);
+        int bytes = column_bytes(count, width);
+
+        memset(&data[size], 0, bytes);
+
+        for (int k = 0, pos = 0; k < count && width; k++, pos += width)
+        {
+            int value = values[k][c] - zone->min[c];
+
+            data[size + (pos >> 3)] |= value << (pos & 7);
+
+            if ((pos & 7) + width > 8)
+                data[size + (pos >> 3) + 1] |= value >> (8 - (pos & 7));
+        }
+
+        size += bytes;
+    }
+
+    /* Lets readers always fetch two bytes at a time */
+    data[size++] = 0;
+    return size;
+}
+
+/* Build the index of n packets (7 bytes each) into a new file, returns 0 on success */
+int codec2_index_write(const char *path, const unsigned char *bits, int n)
+{
+    codec2_index_header header = {{'C', '2', 'I', 'X'}, INDEX_VERSION, n, (n + INDEX_BLOCK - 1) / INDEX_BLOCK};
+    codec2_zone *zones = calloc(header.blocks + 1, sizeof(codec2_zone));
+    uint8_t data[INDEX_BLOCK * INDEX_COLUMNS + 1];
+    FILE *f = fopen(path, "wb");
+    int error = !f || !zones;
+
+    uint32_t offset = sizeof(header) + header.blocks * sizeof(codec2_zone);
+
+    /* Column data first, the zone maps are written once their offsets are known */
+    if (!error)
+        error = fseek(f, offset, SEEK_SET);
+
+    for (uint32_t b = 0; b < header.blocks && !error; b++)
+    {
+        int count = (n - b * INDEX_BLOCK < INDEX_BLOCK) ? n - b * INDEX_BLOCK : INDEX_BLOCK;
+        int size = pack_block(&bits[7 * b * INDEX_BLOCK], count, &zones[b], data);
+
+        zones[b].offset = offset;
+        offset += size;
+
+        error = fwrite(data, 1, size, f) != (size_t)size;
+    }
+
+    if (!error)
+        error = fseek(f, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, f) != 1 ||
+                fwrite(zones, sizeof(codec2_zone), header.blocks, f) != header.blocks;
+
+    if (f && fclose(f))
+        error = 1;
+
+    free(zones);
+    return error ? -1 : 0;
+}
+
+/* Bytes of column data of a block, the padding byte included */
+static size_t block_bytes(const codec2_zone *zone, int count)
+{
+    size_t bytes = 1;
+
+    for (int c = 0; c < INDEX_COLUMNS; c++)
+        bytes += column_bytes(count, width_of(zone->max[c] - zone->min[c]));
+
+    return bytes;
+}
+
+/* Whether the header and every zone map describe data inside the file, so queries never read past it */
+static int index_valid(const codec2_index *index)
+{
+    const codec2_index_header *header = index->header;
+    const size_t zones_end = sizeof(codec2_index_header) + (size_t)header->blocks * sizeof(codec2_zone);
+
+    if (memcmp(header->magic, "C2IX", 4) || header->version != INDEX_VERSION ||
+        header->blocks != (header->packets + (uint64_t)INDEX_BLOCK - 1) / INDEX_BLOCK || index->size < zones_end)
+        return 0;
+
+    for (uint32_t b = 0; b < header->blocks; b++)
+    {
+        const codec2_zone *zone = &index->zones[b];
+
+        for (int c = 0; c < INDEX_COLUMNS; c++)
+            if (zone->min[c] > zone->max[c])
+                return 0;
+
+        if (zone->offset < zones_end || zone->offset + block_bytes(zone, block_packets(index, b)) > index->size)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Map an index read-only, returns 0 or -1 if it cannot be read or is not a valid index */
+int codec2_index_open(codec2_index *index, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(codec2_index_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return -1;
+
+    index->base = base;
+    index->size = st.st_size;
+    index->header = base;
+    index->zones = (const codec2_zone *)(index->base + sizeof(codec2_index_header));
+
+    if (!index_valid(index))
+    {
+        codec2_index_close(index);
+        return -1;
+    }
+
+    return 0;
+}
+
+void codec2_index_close(codec2_index *index)
+{
+    munmap((void *)index->base, index->size);
+    index->base = NULL;
+}
+
+/* Decode one column of a block into values[], returns the number of packets in the block */
+int codec2_index_column(const codec2_index *index, int block, int column, uint8_t values[])
+{
+    const codec2_zone *zone = &index->zones[block];
+    const uint8_t *data = index->base + zone->offset;
+    int count = block_packets(index, block);
+
+    for (int c = 0; c < column; c++)
+        data += column_bytes(count, width_of(zone->max[c] - zone->min[c]));
+
+    int width = width_of(zone->max[column] - zone->min[column]);
+    int mask = (1 << width) - 1;
+
+    if (!width)
+        memset(values, zone->min[column], count);
+
+    for (int k = 0, pos = 0; k < count && width; k++, pos += width)
+    {
+        int word = data[pos >> 3] | (data[(pos >> 3) + 1] << 8);
+        values[k] = zone->min[column] + ((word >> (pos & 7)) & mask);
+    }
+
+    return count;
+}
+
+/* Ends the run that started at *start (if any) at end, keeping it if it is long enough */
+static void end_run(codec2_segment segments[], int *count, int max_segments, int *start, int end, int min_packets)
+{
+    if (*start >= 0 && end - *start >= min_packets && *count < max_segments)
+    {
+        segments[*count].start = *start;
+        segments[(*count)++].end = end;
+    }
+
+    *start = -1;
+}
+
+/* Runs of at least min_packets packets with an energy index of e_min or more */
+int codec2_index_find_energy(const codec2_index *index, int e_min, int min_packets, codec2_segment segments[],
+                             int max_segments)
+{
+    uint8_t energy[INDEX_BLOCK];
+    int count = 0, start = -1;
+
+    for (uint32_t b = 0; b < index->header->blocks; b++)
+    {
+        const codec2_zone *zone = &index->zones[b];
+        int first = b * INDEX_BLOCK;
+
+        if (zone->max[INDEX_ENERGY] < e_min)
+        {
+            end_run(segments, &count, max_segments, &start, first, min_packets);
+            continue;
+        }
+
+        if (zone->min[INDEX_ENERGY] >= e_min)
+        {
+            if (start < 0)
+                start = first;
+            continue;
+        }
+
+        int packets = codec2_index_column(index, b, INDEX_ENERGY, energy);
+
+        for (int k = 0; k < packets; k++)
+        {
+            if (energy[k] < e_min)
+                end_run(segments, &count, max_segments, &start, first + k, min_packets);
+            else if (start < 0)
+                start = first + k;
+        }
+    }
+
+    end_run(segments, &count, max_segments, &start, index->header->packets, min_packets);
+    return count;
+}
+
+/* Runs of packets with at least one voiced frame and a pitch index in Wo_min .. Wo_max */
+int codec2_index_find_pitch(const codec2_index *index, int Wo_min, int Wo_max, codec2_segment segments[],
+                            int max_segments)
+{
+    uint8_t voicing[INDEX_BLOCK], Wo[INDEX_BLOCK];
+    int count = 0, start = -1;
+
+    for (uint32_t b = 0; b < index->header->blocks; b++)
+    {
+        const codec2_zone *zone = &index->zones[b];
+        int first = b * INDEX_BLOCK;
+
+        if (!zone->voiced || zone->max[INDEX_WO] < Wo_min || zone->min[INDEX_WO] > Wo_max)
+        {
+            end_run(segments, &count, max_segments, &start, first, 1);
+            continue;
+        }
+
+        if (zone->min[INDEX_VOICING] && zone->min[INDEX_WO] >= Wo_min && zone->max[INDEX_WO] <= Wo_max)
+        {
+            if (start < 0)
+                start = first;
+            continue;
+        }
+
+        int packets = codec2_index_column(index, b, INDEX_VOICING, voicing);
+        codec2_index_column(index, b, INDEX_WO, Wo);
+
+        for (int k = 0; k < packets; k++)
+        {
+            if (!voicing[k] || Wo[k] < Wo_min || Wo[k] > Wo_max)
+                end_run(segments, &count, max_segments, &start, first + k, 1);
+            else if (start < 0)
+                start = first + k;
+        }
+    }
+
+    end_run(segments, &count, max_segments, &start, index->header->packets, 1);
+    return count;
+}
@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <string.h>
+
+/*
+    The LSFs of every frame are a function of the previous and current packet's LSP indexes
+    and the interpolation step, so keying on the LSF values covers the same combinations
+    (and the initial LSFs set by codec2_init). Together with the pitch layout and the FFT
+    engine they fully determine what lpc_to_amplitudes returns. Entries hold no decoder
+    state, so the cache can be shared by several decoders.
+*/
+uint32_t lpc_cache_hits, lpc_cache_misses;
+
+#if LPC_CACHE_SIZE
+typedef struct
+{
+    const fft_engine *fft; /* Key, NULL while the entry is empty */
+    q31_t lsf[LPC_ORD];
+    q31_t Wo, pitch;
+    int L;
+    uint64_t P[MAX_L + 1]; /* Band powers and filter response, see lpc_to_amplitudes */
+    q31_t H[2 * (MAX_L + 1)];
+} lpc_cache_entry;
+
+lpc_cache_entry lpc_cache[LPC_CACHE_SIZE];
+
+static lpc_cache_entry *lpc_cache_slot(const q31_t lsf[], const MODEL *model)
+{
+    uint32_t hash = model->Wo;
+
+    for (int i = 0; i < LPC_ORD; i++)
+        hash = (hash ^ lsf[i]) * 16777619u;
+
+    return &lpc_cache[hash % LPC_CACHE_SIZE];
+}
+#endif
+
+int lpc_cache_lookup(const fft_engine *fft, const q31_t lsf[], const MODEL *model, uint64_t P[], q31_t H[])
+{
+#if LPC_CACHE_SIZE
+    lpc_cache_entry *entry = lpc_cache_slot(lsf, model);
+
+    if (entry->fft == fft && entry->Wo == model->Wo && entry->pitch == model->pitch && entry->L == model->L &&
+        !memcmp(entry->lsf, lsf, sizeof(entry->lsf)))
+    {
+        memcpy(&P[1], &entry->P[1], model->L * sizeof(P[0]));
+        memcpy(&H[2], &entry->H[2], 2 * model->L * sizeof(H[0]));
+
+        lpc_cache_hits++;
+        return 1;
+    }
+
+    lpc_cache_misses++;
+#else
+    (void)fft, (void)lsf, (void)model, (void)P, (void)H;
+#endif
+    return 0;
+}
+
+void lpc_cache_store(const fft_engine *fft, const q31_t lsf[], const MODEL *model, const uint64_t P[], const q31_t H[])
+{
+#if LPC_CACHE_SIZE
+    lpc_cache_entry *entry = lpc_cache_slot(lsf, model);
+
+    entry->fft = fft;
+    entry->Wo = model->Wo;
+    entry->pitch = model->pitch;
+    entry->L = model->L;
+
+    memcpy(entry->lsf, lsf, sizeof(entry->lsf));
+    memcpy(&entry->P[1], &P[1], model->L * sizeof(P[0]));
+    memcpy(&entry->H[2], &H[2], 2 * model->L * sizeof(H[0]));
+#else
+    (void)fft, (void)lsf, (void)model, (void)P, (void)H;
+#endif
+}
+
+void codec2_lpc_cache_stats(uint32_t *hits, uint32_t *misses)
+{
+    *hits = lpc_cache_hits;
+    *misses = lpc_cache_misses;
+}
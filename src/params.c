@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+/* The parameter decoder keeps its own history, so it can run next to the audio decoder */
+MODEL params_prev_model;
+q31_t params_prev_lsfs[LPC_ORD];
+
+void params_init(void)
+{
+    params_prev_model = (MODEL){.Wo = TAU_Q28 / P_MAX, .pitch = MAX_PITCH, .L = MAX_L, .energy = ONE_IN_Q12};
+
+    for (int i = 0; i < LPC_ORD; i++)
+        params_prev_lsfs[i] = i * (TAU_Q26 / (LPC_ORD + 1));
+}
+
+/*
+    Decode n packets (7 bytes each) down to the model parameters of their 4 * n frames, for
+    analytics that need no audio. Stops after unpacking and interpolation, so it is cheap enough
+    to scan whole archives. Returns the number of frames written to each column.
+*/
+int codec2_decode_params(codec2_params *params, unsigned char *bits, int n)
+{
+    MODEL model[NUM_FRAMES];
+    codec2_pkt pkt;
+
+    q31_t lsf[NUM_FRAMES][LPC_ORD] = {0};
+    int frame = 0;
+
+    for (; n > 0; n--, bits += 7)
+    {
+        unpack_and_decode(model, &pkt, &lsf[3][0], bits, 0);
+        interpolate(model, &params_prev_model, params_prev_lsfs, &lsf[3][0], lsf);
+
+        for (int i = 0; i < NUM_FRAMES; i++, frame++)
+        {
+            if (params->voiced)
+                params->voiced[frame] = model[i].voiced;
+
+            /* f0 = Wo * 8000 / 2 pi, 20372 is 16 * 8000 / 2 pi for Q4 */
+            if (params->f0)
+                params->f0[frame] = model[i].voiced ? (I64(model[i].Wo) * 20372) >> Q28BITS : 0;
+
+            /* 10 log10(E) = 3.0103 log2(E), 12330 is 3.0103 * 2^8 / 2^16 in Q20 */
+            if (params->energy)
+                params->energy[frame] = (I64(log2_q16(model[i].energy) - (Q15BITS << 16)) * 12330) >> 20;
+
+            if (params->L)
+                params->L[frame] = model[i].L;
+
+            if (params->lsf)
+                for (int j = 0; j < LPC_ORD; j++)
+                    params->lsf[frame][j] = lsf[i][j];
+        }
+
+        params_prev_model = model[3];
+
+        for (int i = 0; i < LPC_ORD; i++)
+            params_prev_lsfs[i] = lsf[3][i];
+    }
+
+    return frame;
+}
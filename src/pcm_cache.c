@@ -0,0 +1,360 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Cache of decoded audio for archives many listeners play at once, at different offsets. Files
+    are cut into blocks of PCM_CACHE_BLOCK packets, each decoded once and kept until the cache
+    runs out of bytes. Blocks are keyed by the caller's archive id, the block number and the
+    codec2_settings() of the listener's decoder state, compared in full, so listeners with other
+    output rates or voices share the cache but get blocks of their own.
+    Eviction is CLOCK: the hand passes over the entries, gives those used since its last visit
+    another round and frees the first one that was not.
+
+    A block is always decoded the same way, from the initial decoder state PCM_CACHE_WARMUP
+    packets ahead of it, with those packets thrown away. Its samples are thus the same whoever
+    decoded it first, but they do not line up exactly with the previous block's: at the seam the
+    phase jumps as it does after a cursor seek, the warm-up only settles the smoothing and the
+    envelope. Files shorter than a block decode the same as straight through.
+
+    Any number of threads can read. A miss decodes with the decoder's global state, one at a time
+    under decode_lock, so anything else in the process that decodes while readers run has to take
+    the same lock with codec2_pcm_cache_lock. Hits only read the settings from the listener's
+    state, which is why they are passed in rather than taken from the codec2_set_* globals.
+*/
+
+#define NO_ENTRY (-1)
+
+static uint32_t bucket_of(const codec2_pcm_cache *cache, uint32_t archive, uint32_t block, uint32_t settings)
+{
+    uint32_t hash = archive * 2654435761u ^ block * 2246822519u ^ settings;
+
+    return (hash ^ (hash >> 15)) & cache->bucket_mask;
+}
+
+static int same_settings(const codec2_settings_key *a, const codec2_settings_key *b)
+{
+    return a->rate == b->rate && a->frame_samples == b->frame_samples && a->pitch_scale == b->pitch_scale &&
+           a->formant_scale == b->formant_scale && a->loudness_target == b->loudness_target &&
+           a->silence_floor == b->silence_floor && a->fft == b->fft && a->excite == b->excite && a->eq == b->eq;
+}
+
+/* Entry holding a block, NO_ENTRY if it is not cached. Called with the lock held */
+static int find(codec2_pcm_cache *cache, uint32_t archive, uint32_t block, const codec2_settings_key *settings,
+                uint32_t hash)
+{
+    int i = cache->buckets[bucket_of(cache, archive, block, hash)];
+
+    while (i != NO_ENTRY)
+    {
+        const codec2_pcm_block *entry = &cache->entries[i];
+
+        if (entry->archive == archive && entry->block == block && entry->hash == hash &&
+            same_settings(&entry->settings, settings))
+            return i;
+
+        i = entry->next;
+    }
+
+    return NO_ENTRY;
+}
+
+static void evict(codec2_pcm_cache *cache, int index)
+{
+    codec2_pcm_block *entry = &cache->entries[index];
+    int *link = &cache->buckets[bucket_of(cache, entry->archive, entry->block, entry->hash)];
+
+    while (*link != index)
+        link = &cache->entries[*link].next;
+
+    *link = entry->next;
+    cache->used -= (size_t)entry->packets * entry->samples * sizeof(short);
+    free(entry->pcm);
+    entry->pcm = NULL;
+}
+
+/*
+    A free entry with room for bytes more, evicting with the clock hand as needed. NO_ENTRY if
+    readers hold too much of the cache to make room. Called with the lock held.
+*/
+static int make_room(codec2_pcm_cache *cache, size_t bytes)
+{
+    int free_entry = NO_ENTRY;
+
+    /* The first round may only clear referenced bits, the second evicts what readers do not hold */
+    for (int step = 0; step < 2 * cache->count; step++)
+    {
+        if (free_entry != NO_ENTRY && cache->used + bytes <= cache->capacity)
+            return free_entry;
+
+        codec2_pcm_block *entry = &cache->entries[cache->hand];
+        int index = cache->hand;
+
+        cache->hand = (cache->hand + 1) % cache->count;
+
+        if (!entry->pcm)
+        {
+            if (free_entry == NO_ENTRY)
+                free_entry = index;
+        }
+        else if (entry->readers)
+            continue;
+        else if (entry->referenced)
+            entry->referenced = 0;
+        else
+        {
+            evict(cache, index);
+
+            if (free_entry == NO_ENTRY)
+                free_entry = index;
+        }
+    }
+
+    return (free_entry != NO_ENTRY && cache->used + bytes <= cache->capacity) ? free_entry : NO_ENTRY;
+}
+
+/* Decode packets of a block from position start of the file into pcm, the warm-up included */
+static int decode_block(const codec2_reader *reader, const codec2_state *listener, uint32_t start, int packets,
+                        short pcm[])
+{
+    codec2_cursor cursor;
+    const int warmup = (start < PCM_CACHE_WARMUP) ? start : PCM_CACHE_WARMUP;
+    const int samples = NUM_FRAMES * listener->frame_samples * listener->rate;
+
+    /* The warm-up gets a buffer of its own, a final block can be shorter than it */
+    short *scratch = malloc((size_t)(warmup ? warmup : 1) * samples * sizeof(short));
+
+    if (!scratch)
+        return -1;
+
+    if (codec2_cursor_open(&cursor, reader, start - warmup) < 0)
+    {
+        free(scratch);
+        return -1;
+    }
+
+    cursor.state.rate = listener->rate;
+    cursor.state.frame_samples = listener->frame_samples;
+    cursor.state.pitch_scale = listener->pitch_scale;
+    cursor.state.formant_scale = listener->formant_scale;
+    cursor.state.eq = listener->eq;
+    cursor.state.loudness_target = listener->loudness_target;
+
+    int decoded = codec2_cursor_decode(&cursor, scratch, warmup);
+
+    if (decoded == warmup)
+        decoded = codec2_cursor_decode(&cursor, pcm, packets);
+
+    codec2_cursor_close(&cursor);
+    free(scratch);
+    return (decoded == packets) ? 0 : -1;
+}
+
+/* Set up an empty cache holding up to bytes of decoded audio, returns 0 or -1 */
+int codec2_pcm_cache_open(codec2_pcm_cache *cache, size_t bytes)
+{
+    /* Enough entries for blocks at the current settings, plus some for shorter final blocks and
+       listeners at lower rates */
+    const size_t block_bytes = (size_t)PCM_CACHE_BLOCK * codec2_samples_per_packet() * sizeof(short);
+    const size_t count = bytes / block_bytes + 16;
+    int buckets = 1;
+
+    while (buckets < 2 * (int)count)
+        buckets <<= 1;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->capacity = bytes;
+    cache->count = count;
+    cache->bucket_mask = buckets - 1;
+    cache->entries = calloc(count, sizeof(codec2_pcm_block));
+    cache->buckets = malloc(buckets * sizeof(int));
+    cache->lock = malloc(sizeof(pthread_mutex_t));
+    cache->decode_lock = malloc(sizeof(pthread_mutex_t));
+
+    if (!cache->entries || !cache->buckets || !cache->lock || !cache->decode_lock)
+    {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache->lock);
+        free(cache->decode_lock);
+        return -1;
+    }
+
+    for (int i = 0; i < buckets; i++)
+        cache->buckets[i] = NO_ENTRY;
+
+    pthread_mutex_init(cache->lock, NULL);
+    pthread_mutex_init(cache->decode_lock, NULL);
+    return 0;
+}
+
+/* Free all blocks, once no thread reads any more */
+void codec2_pcm_cache_close(codec2_pcm_cache *cache)
+{
+    for (int i = 0; i < cache->count; i++)
+        free(cache->entries[i].pcm);
+
+    pthread_mutex_destroy(cache->lock);
+    pthread_mutex_destroy(cache->decode_lock);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache->lock);
+    free(cache->decode_lock);
+    cache->entries = NULL;
+}
+
+/*
+    Decoded samples of up to n packets from packet position of the file reader maps, the caller's
+    archive id tells files apart. The output rate, speed, voice, equaliser and loudness are those
+    of the listener's state, as codec2_default_state takes them from the codec2_set_* functions.
+    Fills speech with the samples per packet of those settings and returns how many packets were
+    read, fewer at the end of the file or if decoding fails.
+*/
+int codec2_pcm_cache_read(codec2_pcm_cache *cache, const codec2_reader *reader, uint32_t archive,
+                          const codec2_state *listener, uint32_t position, short speech[], int n)
+{
+    const int samples = NUM_FRAMES * listener->frame_samples * listener->rate;
+    codec2_settings_key settings;
+    const uint32_t hash = codec2_settings(listener, &settings);
+    int done = 0;
+
+    while (done < n && position < reader->packets)
+    {
+        const uint32_t block = position / PCM_CACHE_BLOCK, start = block * PCM_CACHE_BLOCK;
+        const int packets = (reader->packets - start < PCM_CACHE_BLOCK) ? reader->packets - start : PCM_CACHE_BLOCK;
+        const int offset = position - start;
+        const int count = (packets - offset < n - done) ? packets - offset : n - done;
+        const size_t bytes = (size_t)count * samples * sizeof(short);
+        short *pcm = NULL, *uncached = NULL;
+        int index;
+
+        pthread_mutex_lock(cache->lock);
+        index = find(cache, archive, block, &settings, hash);
+
+        if (index == NO_ENTRY)
+        {
+            /* Decode with the table unlocked, then look again in case another thread did it first */
+            pthread_mutex_unlock(cache->lock);
+            pthread_mutex_lock(cache->decode_lock);
+            pthread_mutex_lock(cache->lock);
+            index = find(cache, archive, block, &settings, hash);
+
+            if (index == NO_ENTRY)
+            {
+                const size_t block_bytes = (size_t)packets * samples * sizeof(short);
+
+                pthread_mutex_unlock(cache->lock);
+
+                if (!(uncached = malloc(block_bytes)) || decode_block(reader, listener, start, packets, uncached) < 0)
+                {
+                    pthread_mutex_unlock(cache->decode_lock);
+                    free(uncached);
+                    return done;
+                }
+
+                pthread_mutex_lock(cache->lock);
+                cache->misses++;
+
+                if ((index = make_room(cache, block_bytes)) != NO_ENTRY)
+                {
+                    codec2_pcm_block *entry = &cache->entries[index];
+                    int *bucket = &cache->buckets[bucket_of(cache, archive, block, hash)];
+
+                    entry->archive = archive;
+                    entry->block = block;
+                    entry->settings = settings;
+                    entry->hash = hash;
+                    entry->packets = packets;
+                    entry->samples = samples;
+                    entry->readers = 0;
+                    entry->referenced = 1;
+                    entry->pcm = uncached;
+                    entry->next = *bucket;
+                    *bucket = index;
+                    cache->used += block_bytes;
+                    uncached = NULL;
+                }
+            }
+            else
+            {
+                cache->hits++;
+                cache->bytes_saved += bytes;
+            }
+
+            pthread_mutex_unlock(cache->decode_lock);
+        }
+        else
+        {
+            cache->hits++;
+            cache->bytes_saved += bytes;
+        }
+
+        /* Readers keep the entry from being evicted while copying out of it unlocked */
+        if (index != NO_ENTRY)
+        {
+            codec2_pcm_block *entry = &cache->entries[index];
+
+            entry->readers++;
+            entry->referenced = 1;
+            pcm = entry->pcm;
+        }
+
+        pthread_mutex_unlock(cache->lock);
+
+        memcpy(speech, (uncached ? uncached : pcm) + (size_t)offset * samples, bytes);
+        free(uncached);
+
+        if (index != NO_ENTRY)
+        {
+            pthread_mutex_lock(cache->lock);
+            cache->entries[index].readers--;
+            pthread_mutex_unlock(cache->lock);
+        }
+
+        speech += (size_t)count * samples;
+        position += count;
+        done += count;
+    }
+
+    return done;
+}
+
+/*
+    Keep cache misses off the decoder's global state, for other decoding (codec2_decode, cursors,
+    codec2_mix, a broadcast publisher) while readers may be running. Not to be held while calling
+    codec2_pcm_cache_read.
+*/
+void codec2_pcm_cache_lock(codec2_pcm_cache *cache)
+{
+    pthread_mutex_lock(cache->decode_lock);
+}
+
+void codec2_pcm_cache_unlock(codec2_pcm_cache *cache)
+{
+    pthread_mutex_unlock(cache->decode_lock);
+}
+
+/* Blocks found and blocks decoded so far, and the bytes of audio served without decoding */
+void codec2_pcm_cache_stats(codec2_pcm_cache *cache, uint64_t *hits, uint64_t *misses, uint64_t *bytes_saved)
+{
+    pthread_mutex_lock(cache->lock);
+    *hits = cache->hits;
+    *misses = cache->misses;
+    *bytes_saved = cache->bytes_saved;
+    pthread_mutex_unlock(cache->lock);
+}
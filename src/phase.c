@@ -14,7 +14,7 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 
 #define BIT(a) (lfsr >> (a))
 
-uint32_t lfsr = 0xDEADBEEF; /* PRNG seed */
+uint32_t lfsr = LFSR_SEED;
 uint32_t get_random_number(void)
 {
     uint32_t bit = (BIT(0) ^ BIT(1) ^ BIT(2) ^ BIT(4) ^ BIT(6) ^ BIT(31)) & 1;
@@ -22,58 +22,88 @@ uint32_t get_random_number(void)
     return lfsr;
 }
 
-void phase_synth(MODEL *model, q31_t *prev_phase, q31_t A[])
+static void advance_phase(MODEL *model, q31_t *prev_phase, int n)
 {
-    q31_t Ex[2 * N_SPF + 2] = {0};
-    q31_t H[2 * N_SPF + 2];
+    /* Since Wo is in Q28 and phase chosen to be Q24, Wo * n / 16 is in fact multiplication by the
+       n samples of the frame (Wo * 5 for N_SPF). This step updates phase and brings angle back
+       to <-pi, pi> */
+    for (*prev_phase += (I64(model->Wo) * n) >> 4; *prev_phase >= PI_Q24;)
+        *prev_phase -= TAU_Q24;
+}
 
-    /* Shift to Q18, divide by Q9 -> back to Q9 */
-    const int step = (FFT_SIZE << Q18BITS) / model->pitch;
+/* Leave the phase and the noise generator where phase_synth would, without synthesising */
+void phase_skip(MODEL *model, q31_t *prev_phase, int n)
+{
+    advance_phase(model, prev_phase, n);
 
-    for (int m = 1, i = HALF_FFT_SIZE; m <= model->L; m++, i += step)
-    {
-        int b = (i >> Q9BITS);
-        H[2 * m] = A[2 * b] << 2;
-        H[2 * m + 1] = -(A[2 * b + 1] << 2);
-    }
+    if (!model->voiced)
+        for (int m = 0; m < 2 * model->L; m++)
+            get_random_number();
+}
 
-    /* Since Wo is in Q28 and phase chosen to be Q24, Wo * 5 is in fact multiplication by 80
-       This step updates phase and brings angle back to <-pi, pi> */
-    for (*prev_phase += model->Wo * 5; *prev_phase >= PI_Q24;)
-        *prev_phase -= TAU_Q24;
+/* Voiced excitation {cos(mx), sin(mx)} of each harmonic by the Chebyshev recurrence, filtered by H */
+static void fixed_voiced(MODEL *model, q31_t cos_x, q31_t sin_x, const q31_t H[])
+{
+    /* Excitation of the current and the previous harmonic in Q27, harmonic 0 is cos(0) = 1, sin(0) = 0 */
+    q31_t ex_re = cos_x, ex_im = sin_x;
+    q31_t prev_re = ONE_IN_Q27, prev_im = 0;
 
-    if (!model->voiced)
-    {
-        /* In unvoiced case, set vectors to random */
-        for (int m = 0; m <= 2 * model->L + 1; m++)
-            Ex[m] = get_random_number();
-    }
-    else
+    /* Calculate the common term outside of the loop */
+    q63_t _2_Ex2 = 2L * (q63_t)ex_re;
+
+    /* Generate the excitation of each harmonic and apply the LPC filter response to it, all in
+       one pass instead of filling intermediate arrays for each step */
+    for (int m = 1; m <= model->L; m++)
     {
-        /* prepare the phase angle, convert from Q24 to Q27 */
-        q31_t phase = *prev_phase << 3;
+        q31_t h_re = H[2 * m] << 2;
+        q31_t h_im = -(H[2 * m + 1] << 2);
+
+        model->Af[2 * m] = SUB(MUL(h_re, ex_re), MUL(h_im, ex_im));
+        model->Af[2 * m + 1] = ADD(MUL(h_re, ex_im), MUL(h_im, ex_re));
+
+        /* cos(nx) = 2 * cos((n-1)x) * cos(x) - cos((n-2)x) */
+        q31_t next_re = ((ex_re * _2_Ex2) >> Q27BITS) - prev_re;
 
-        /* Set the initial conditions for our recursion */
-        Ex[0] = ONE_IN_Q27; /* cos(0) = 1 */
-        Ex[1] = 0;          /* sin(0) = 0 */
+        /* sin(nx) = 2 * sin((n-1)x) * cos(x) - sin((n-2)x) */
+        q31_t next_im = ((ex_im * _2_Ex2) >> Q27BITS) - prev_im;
 
-        /* Ex[2] = cos(x) -> real part,
-           Ex[3] = sin(x) -> imaginary part */
-        cordic(phase, &Ex[3], &Ex[2]);
+        prev_re = ex_re;
+        prev_im = ex_im;
+        ex_re = next_re;
+        ex_im = next_im;
+    }
+}
 
-        /* Calculate the common term outside of the loop */
-        q63_t _2_Ex2 = 2L * (q63_t)Ex[2];
+/* The fixed point recurrence, exact on every target */
+const excite_engine excite_fixed = {
+    .name = "fixed-q27",
+    .voiced = fixed_voiced,
+};
 
-        for (int m = 2; m <= model->L; m++)
-        {
-            /* sin(nx) = 2 * sin((n-1)x) * cos(x) - sin((n-2)x) */
-            Ex[2 * m + 1] = ((Ex[2 * m - 1] * _2_Ex2) >> Q27BITS) - Ex[2 * m - 3];
+/* Excitation of a frame lasting n samples (at 8 kHz) filtered by H, into model->Af */
+void phase_synth(const excite_engine *excite, MODEL *model, q31_t *prev_phase, const q31_t H[], int n)
+{
+    advance_phase(model, prev_phase, n);
 
-            /* cos(nx) = 2 * cos((n-1)x) * cos(x) - cos((n-2)x) */
-            Ex[2 * m] = ((Ex[2 * m - 2] * _2_Ex2) >> Q27BITS) - Ex[2 * m - 4];
-        }
+    if (model->voiced)
+    {
+        q31_t cos_x, sin_x;
+
+        /* Harmonic 1, cordic takes the phase angle in Q27 */
+        cordic(*prev_phase << 3, &sin_x, &cos_x);
+        excite->voiced(model, cos_x, sin_x, H);
+        return;
     }
 
-    /* Apply LPC filter to the excitation sample */
-    complex_multiply(H, Ex, model->Af, model->L);
+    /* Unvoiced, the excitation is random */
+    for (int m = 1; m <= model->L; m++)
+    {
+        q31_t h_re = H[2 * m] << 2;
+        q31_t h_im = -(H[2 * m + 1] << 2);
+        q31_t ex_re = get_random_number();
+        q31_t ex_im = get_random_number();
+
+        model->Af[2 * m] = SUB(MUL(h_re, ex_re), MUL(h_im, ex_im));
+        model->Af[2 * m + 1] = ADD(MUL(h_re, ex_im), MUL(h_im, ex_re));
+    }
 }
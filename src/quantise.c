@@ -11,7 +11,6 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 
 #include "codec2.h"
 #include "defines.h"
-#include "fft_tables.h"
 #include "fxpmath.h"
 
 /* Helper function to calculate the linear prediction polynomial coefficients. */
@@ -84,10 +83,9 @@ void check_lsp_order(q31_t lsp[])
     }
 }
 
-static void lpc_post_filter(uint64_t Pw[], q31_t Aw[])
+static void lpc_power_spectrum(uint64_t Pw[], q31_t Aw[])
 {
-    Pw[0] = 0;
-
+    /* Pw = 1 / |A|^2 in Q13 */
     for (int i = 0; i < (FFT_SIZE / 2); i++)
     {
         uint64_t re2 = (uint64_t)((q63_t)Aw[2 * i] * (q63_t)Aw[2 * i]);
@@ -95,47 +93,140 @@ static void lpc_post_filter(uint64_t Pw[], q31_t Aw[])
 
         uint32_t mag_inv = SAT((re2 + im2) >> Q9BITS);
 
-        Pw[i] = (uint32_t)(ONE_IN_Q32 / mag_inv);
+        Pw[i] = (uint32_t)(ONE_IN_Q32 / (mag_inv ? mag_inv : 1));
+    }
+}
+
+/*
+    LPC post filter as in Codec2, scales the power spectrum by (|W|^2 / |A|^2)^beta where
+    W(z) = A(z / gamma), then restores the energy and adds 3 dB below 1 kHz.
+
+    Codec2 gets W with another FFT. Here |W|^2 is only evaluated at the band centres, as
+    r0 + 2 sum(r_k cos(k w)) from the autocorrelation r_k of the weighted coefficients, and
+    1 / |A|^2 is the band average of Pw. gamma = 0.5 so the weighting is a shift, beta = 0.2.
+*/
+static void lpc_post_filter(uint64_t P[], const uint8_t bins[], q31_t ak[], MODEL *model)
+{
+    q31_t w[LPC_ORD + 1], r[LPC_ORD + 1], sin, cos;
+    uint32_t G[MAX_L + 1];
+    uint64_t e_before = 0, e_after = 0;
+
+    for (int k = 0; k <= LPC_ORD; k++)
+        w[k] = ak[k] >> k;
+
+    /* Autocorrelation in Q23, doubled for k > 0 */
+    for (int k = 0; k <= LPC_ORD; k++)
+    {
+        q63_t acc = 0;
+
+        for (int i = 0; i + k <= LPC_ORD; i++)
+            acc += (q63_t)w[i] * w[i + k];
 
-        /* Simple noise filter threshold  */
-        if (Pw[i] < ONE_IN_Q12)
-            Pw[i] = 0;
-        else
-            Pw[i] -= ONE_IN_Q12;
+        r[k] = (acc >> (k ? Q23BITS - 1 : Q23BITS));
+    }
+
+    /* cos(m Wo) for m = 1, 2, ... by the Chebyshev recurrence, Q27 */
+    cordic(model->Wo >> 1, &sin, &cos);
+
+    q63_t _2_cos_Wo = 2L * (q63_t)cos;
+    q31_t cos_m = cos, cos_prev = ONE_IN_Q27;
+
+    for (int m = 1; m <= model->L; m++)
+    {
+        /* |W|^2 in Q23 by Clenshaw's recurrence */
+        q63_t b1 = 0, b2 = 0, _2x = 2L * (q63_t)cos_m;
+
+        for (int k = LPC_ORD; k > 0; k--)
+        {
+            q63_t b0 = r[k] + ((_2x * b1) >> Q27BITS) - b2;
+            b2 = b1;
+            b1 = b0;
+        }
+
+        q63_t W2 = r[0] + ((cos_m * b1) >> Q27BITS) - b2;
+
+        /* log2(|W|^2 / |A|^2) in Q16, both terms carry their Q23 and Q13 scaling */
+        int32_t log_ratio = log2_q16(W2 > 0 ? W2 : 1) + log2_q16(P[m] ? P[m] : 1) - log2_q16(bins[m]) - (36 << 16);
+
+        /* beta = 0.2, limited to +-12 dB */
+        int32_t log_gain = (int32_t)(((q63_t)log_ratio * 13107) >> 16);
+        log_gain = SAT_PLUS(SAT_MINUS(log_gain, (4 << 16)), (4 << 16));
+
+        G[m] = exp2_q16(log_gain);
+
+        e_before += P[m];
+        e_after += (P[m] * G[m]) >> 16;
+
+        q31_t cos_next = ((cos_m * _2_cos_Wo) >> Q27BITS) - cos_prev;
+        cos_prev = cos_m;
+        cos_m = cos_next;
+    }
+
+    if (!e_after)
+        return;
+
+    uint32_t gain = (e_before << 16) / e_after;
+
+    for (int m = 1; m <= model->L; m++)
+    {
+        uint32_t g = ((uint64_t)G[m] * gain) >> 16;
+
+        /* 3 dB bass boost below 1 kHz, 1.4^2 in Q16 */
+        if (m * model->Wo < PI_Q28 / 4)
+            g = ((uint64_t)g * 128451) >> 16;
+
+        P[m] = (P[m] * g) >> 16;
     }
 }
 
-/* Convert LPC indexes to frequency domain amplitudes */
-void lpc_to_amplitudes(arm_rfft_instance_q31 *arm_fft, q31_t ak[], MODEL *model, q31_t E, q31_t Aw[], int e_index)
+/*
+    Convert LPC coefficients to the post filtered power P[m] of each harmonic band, before
+    energy scaling, and pick the filter response H at each harmonic for phase_synth. Both only
+    depend on the LSFs and the pitch, which is what lpc_cache keys on.
+*/
+void lpc_to_amplitudes(const fft_engine *fft, q31_t ak[], MODEL *model, uint64_t P[], q31_t H[])
 {
     uint64_t Pw[FFT_SIZE / 2 + 1] = {0};
     q31_t lpc_coeffs[FFT_SIZE] = {0};
-    uint64_t bin_power, Am;
+    q31_t Aw[FFT_SIZE + 2];
+    uint8_t bins[MAX_L + 1];
 
     for (int i = 0; i <= LPC_ORD; i++)
         lpc_coeffs[i] = ak[i];
 
     /* Apply FFT transform on LPC coefficients */
-    arm_rfft_q31(arm_fft, lpc_coeffs, Aw);
-    lpc_post_filter(Pw, Aw);
+    fft->forward(lpc_coeffs, Aw);
+    lpc_power_spectrum(Pw, Aw);
 
-    int start = (model->Wo / TAU_Q11);
-    int step = 2 * start;
+    const harmonic_geometry *geometry = get_harmonic_geometry(model);
 
-    for (int m = 1, i = (start); m <= model->L; m++, i += step)
+    for (int m = 1; m <= model->L; m++)
     {
-        /* Calculate band limits */
-        int am = (i + ONE_HALF_IN_Q9) >> Q9BITS;
-        int bm = (i + step + ONE_HALF_IN_Q9) >> Q9BITS;
-
-        if (bm > FFT_SIZE / 2)
-            bm = FFT_SIZE / 2;
+        /* Band limits */
+        int am = geometry->edge[m - 1];
+        int bm = geometry->edge[m];
 
-        bin_power = 0;
+        P[m] = 0;
         for (int j = am; j < bm; j++)
-            bin_power += Pw[j];
+            P[m] += Pw[j];
+
+        bins[m] = (bm > am) ? bm - am : 1;
+
+        /* phase_synth takes the response at the bin of the harmonic below */
+        int b = geometry->bin[m - 1];
+        H[2 * m] = Aw[2 * b];
+        H[2 * m + 1] = Aw[2 * b + 1];
+    }
+
+    lpc_post_filter(P, bins, ak, model);
+}
 
-        Am = MUL_SHIFT(E, bin_power, 16);
+/* Scale the band powers by the frame energy into harmonic amplitudes */
+void scale_amplitudes(MODEL *model, q31_t E, const uint64_t P[])
+{
+    for (int m = 1; m <= model->L; m++)
+    {
+        uint64_t Am = MUL_SHIFT(E, P[m], 16);
 
         /* Am *= 0.75 */
         if (Am > model->A[m])
@@ -0,0 +1,215 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    Reader for packet files that are too big to compile in like coded_data[]. The file is
+    mapped read-only once, and any number of cursors stream from it, each with a decoder state
+    of its own, so all listeners share one copy in the page cache. Raw and dense packets are
+    handed to the decoder straight out of the mapping. Archives are decoded a block at a time
+    into the cursor.
+
+    Each cursor asks the kernel to read READER_READAHEAD bytes ahead of it, half a window
+    before it gets there. The decoder itself keeps global state, cursors swap theirs in and
+    out around decoding, so calls on cursors must not overlap (keep them on one thread).
+*/
+
+/* Byte offset of a packet in the file, for the read ahead hints */
+static size_t packet_offset(const codec2_reader *reader, uint32_t position)
+{
+    if (reader->format == CODEC2_FORMAT_RAW)
+        return (size_t)7 * position;
+
+    if (reader->format == CODEC2_FORMAT_DENSE)
+        return (size_t)13 * (position >> 1) + 6 * (position & 1);
+
+    const codec2_archive_header *header = (const codec2_archive_header *)reader->base;
+    const uint32_t *offsets = (const uint32_t *)(reader->base + sizeof(codec2_archive_header));
+
+    return offsets[position / header->block_packets];
+}
+
+static void read_ahead(codec2_cursor *cursor)
+{
+    const codec2_reader *reader = cursor->reader;
+    size_t offset = packet_offset(reader, cursor->position);
+
+    if (offset + READER_READAHEAD / 2 < cursor->readahead || cursor->readahead >= reader->size)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+    size_t end = (offset + READER_READAHEAD < reader->size) ? offset + READER_READAHEAD : reader->size;
+
+    madvise((void *)(reader->base + start), end - start, MADV_WILLNEED);
+    cursor->readahead = end;
+}
+
+/* Map a packet file read-only, format is one of CODEC2_FORMAT_*, returns 0 on success */
+int codec2_reader_open(codec2_reader *reader, const char *path, int format, int flags)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) || st.st_size == 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | ((flags & CODEC2_READER_POPULATE) ? MAP_POPULATE : 0),
+                      fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return -1;
+
+#ifdef MADV_HUGEPAGE
+    /* Only a hint, most file systems cannot back files with huge pages */
+    if (flags & CODEC2_READER_HUGE_PAGES)
+        madvise(base, st.st_size, MADV_HUGEPAGE);
+#endif
+
+    reader->base = base;
+    reader->size = st.st_size;
+    reader->format = format;
+
+    const codec2_archive_header *header = base;
+
+    if (format == CODEC2_FORMAT_RAW)
+        reader->packets = reader->size / 7;
+    else if (format == CODEC2_FORMAT_DENSE)
+        reader->packets = (reader->size / 13) * 2 + (reader->size % 13 >= 7);
+    else if (format == CODEC2_FORMAT_ARCHIVE && reader->size >= sizeof(codec2_archive_header) &&
+             !memcmp(header->magic, "C2AR", 4) && header->block_packets &&
+             header->packets <= (uint64_t)header->blocks * header->block_packets &&
+             reader->size >= sizeof(codec2_archive_header) + (header->blocks + (size_t)1) * sizeof(uint32_t))
+        reader->packets = header->packets;
+    else
+    {
+        codec2_reader_close(reader);
+        return -1;
+    }
+
+    return 0;
+}
+
+void codec2_reader_close(codec2_reader *reader)
+{
+    munmap((void *)reader->base, reader->size);
+    reader->base = NULL;
+}
+
+/* Start a cursor at packet position, with the decoder state codec2_init starts from */
+int codec2_cursor_open(codec2_cursor *cursor, const codec2_reader *reader, uint32_t position)
+{
+    cursor->reader = reader;
+    cursor->archive = NULL;
+    cursor->block = -1;
+
+    if (reader->format == CODEC2_FORMAT_ARCHIVE && !(cursor->archive = malloc(sizeof(codec2_archive_workspace))))
+        return -1;
+
+    return codec2_cursor_seek(cursor, position);
+}
+
+void codec2_cursor_close(codec2_cursor *cursor)
+{
+    free(cursor->archive);
+    cursor->archive = NULL;
+}
+
+/* Jump to packet position, decoding starts over from the initial state there */
+int codec2_cursor_seek(codec2_cursor *cursor, uint32_t position)
+{
+    if (position > cursor->reader->packets)
+        return -1;
+
+    cursor->position = position;
+    cursor->readahead = 0;
+    codec2_default_state(&cursor->state);
+    return 0;
+}
+
+/*
+    The next packet, or NULL at the end. Raw and dense packets point into the mapping, is_odd
+    is set for the second packet of a dense pair, which takes codec2_decode_odd.
+*/
+const unsigned char *codec2_cursor_next(codec2_cursor *cursor, int *is_odd)
+{
+    const codec2_reader *reader = cursor->reader;
+    uint32_t position = cursor->position;
+
+    if (position >= reader->packets)
+        return NULL;
+
+    read_ahead(cursor);
+    cursor->position++;
+    *is_odd = 0;
+
+    if (reader->format == CODEC2_FORMAT_RAW)
+        return reader->base + (size_t)7 * position;
+
+    if (reader->format == CODEC2_FORMAT_DENSE)
+    {
+        *is_odd = position & 1;
+        return reader->base + (size_t)13 * (position >> 1) + 6 * (position & 1);
+    }
+
+    uint32_t block_packets = ((const codec2_archive_header *)reader->base)->block_packets;
+    int block = position / block_packets;
+
+    if (block != cursor->block)
+    {
+        cursor->block = -1;
+
+        if (codec2_archive_block(cursor->archive, reader->base, reader->size, block, cursor->archive->packets) < 0)
+            return NULL;
+
+        cursor->block = block;
+    }
+
+    return &cursor->archive->packets[7 * (position - block * block_packets)];
+}
+
+/* Decode up to n packets into speech, codec2_samples_per_packet() samples each at the cursor's output
+   rate and speed, returns how many were decoded */
+int codec2_cursor_decode(codec2_cursor *cursor, short speech[], int n)
+{
+    const unsigned char *bits;
+    int count = 0, is_odd;
+
+    codec2_load_state(&cursor->state);
+
+    for (; count < n && (bits = codec2_cursor_next(cursor, &is_odd)); count++, speech += codec2_samples_per_packet())
+    {
+        if (is_odd)
+            codec2_decode_odd(speech, (unsigned char *)bits);
+        else
+            codec2_decode(speech, (unsigned char *)bits);
+    }
+
+    codec2_save_state(&cursor->state);
+    return count;
+}
@@ -0,0 +1,64 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "defines.h"
+#include "fxpmath.h"
+
+/*
+    Find speech in n packed packets (7 bytes each, as codec2_decode takes them) without
+    unpacking them. The 4 voicing bits are the top nibble of byte 0, the Gray coded energy
+    index the low 5 bits of byte 1. Gray code is not monotonic, so the energy threshold is
+    turned into a 32 bit mask of the codes at or above it, which makes the test per packet a
+    shift and two ORs.
+
+    A packet is active if any of its frames is voiced or its energy index is at least
+    e_threshold. Segments are extended by hangover packets after the last active one, which
+    also merges segments closer than that. Writes up to max_segments segments (end exclusive)
+    and returns how many were written.
+*/
+int codec2_scan_speech(const unsigned char *bits, int n, int e_threshold, int hangover, codec2_segment segments[],
+                       int max_segments)
+{
+    uint32_t loud = 0;
+    int count = 0, start = -1, last = 0;
+
+    for (int code = 0; code < 32; code++)
+        if (decode_gray(code) >= e_threshold)
+            loud |= 1u << code;
+
+    for (int i = 0; i < n && count < max_segments; i++, bits += 7)
+    {
+        int active = (bits[0] >> 4) | ((loud >> (bits[1] & 0x1f)) & 1);
+
+        if (active)
+        {
+            if (start < 0)
+                start = i;
+
+            last = i;
+        }
+        else if (start >= 0 && i - last > hangover)
+        {
+            segments[count].start = start;
+            segments[count++].end = last + hangover + 1;
+            start = -1;
+        }
+    }
+
+    if (start >= 0 && count < max_segments)
+    {
+        segments[count].start = start;
+        segments[count++].end = (last + hangover + 1 < n) ? last + hangover + 1 : n;
+    }
+
+    return count;
+}
@@ -10,74 +10,197 @@ Copyright (c) 2023 Hrvoje Cavrak, David Rowe
 */
 #include "codec2.h"
 #include "defines.h"
-#include "dsp/transform_functions.h"
 #include "fxpmath.h"
 
-void freq_domain_calc(q31_t Sw_[], MODEL *model)
+#include <string.h>
+
+/* Add the harmonics to Sw_, eq holds a Q16 gain for each bin, NULL leaves them flat. Harmonics of
+   one model never share a bin, several models (talkers) add up */
+void freq_domain_calc(q31_t Sw_[], MODEL *model, const q31_t eq[])
 {
-    /* Shift to Q18, divide by Q9 -> back to Q9 */
-    const int step = (FFT_SIZE << Q18BITS) / model->pitch;
+    const harmonic_geometry *geometry = get_harmonic_geometry(model);
 
-    for (int j = 1, i = ONE_HALF_IN_Q9 + step; j <= model->L; j++, i += step)
+    for (int j = 1; j <= model->L; j++)
     {
-        int k = (i >> Q9BITS);
-
-        /* Prevent index exceeding the array maximum */
-        if (k >= FFT_SIZE >> 1)
-            k = (FFT_SIZE >> 1) - 1;
+        /* Already limited to the array maximum */
+        int k = geometry->bin[j];
+        q31_t A = eq ? SAT((I64(model->A[j]) * eq[k]) >> 16) : model->A[j];
 
         /* Approximate the magnitude and use {re, im} / magnitude to get the trig values */
         int64_t magnitude = estimate_magnitude(model->Af[2 * j], model->Af[2 * j + 1]) << 1;
 
+        /* Both components are zero so the result is too, just don't divide by zero (traps on x86) */
+        if (magnitude == 0)
+            magnitude = 1;
+
         /* real Sw[k] = A[j] * cos(phi) */
-        int64_t real = (model->A[j] * ((int64_t)model->Af[2 * j])) / magnitude;
+        int64_t real = (A * ((int64_t)model->Af[2 * j])) / magnitude;
 
         /* imag Sw[k] = A[j] * sin(phi) */
-        int64_t imag = (model->A[j] * ((int64_t)model->Af[2 * j + 1])) / magnitude;
+        int64_t imag = (A * ((int64_t)model->Af[2 * j + 1])) / magnitude;
 
-        Sw_[2 * k] = real;
-        Sw_[2 * k + 1] = imag;
+        /* Saturated, codec2_mix adds any number of talkers at any gain into the same bins */
+        Sw_[2 * k] = SAT(I64(Sw_[2 * k]) + real);
+        Sw_[2 * k + 1] = SAT(I64(Sw_[2 * k + 1]) + imag);
 
         /* Using the frequency domain symmetry */
-        Sw_[2 * FFT_SIZE - 2 * k] = real;
-        Sw_[2 * FFT_SIZE - 2 * k + 1] = -imag;
+        Sw_[2 * FFT_SIZE - 2 * k] = SAT(I64(Sw_[2 * FFT_SIZE - 2 * k]) + real);
+        Sw_[2 * FFT_SIZE - 2 * k + 1] = SAT(I64(Sw_[2 * FFT_SIZE - 2 * k + 1]) - imag);
     }
 }
 
-int synthesise(arm_rfft_instance_q31 *fft, q31_t Sn_[], MODEL *model, const q31_t Pn[])
+/*
+    Higher output rates use the same transform: the spectrum is band limited to 4 kHz, so the
+    samples in between the 8 kHz ones are the inverse transforms of the same bins, delayed by a
+    fraction of a sample. Delaying by 1 / rate of a sample rotates bin k by
+    2 pi k / (FFT_SIZE * rate), delay_rotation[] holds those rotations in Q27 for the rate in
+    delay_rate. Both are filled in on first use of a rate.
+
+    This is the polyphase split of one FFT_SIZE * rate point inverse transform. That transform
+    would have all but HALF_FFT_SIZE of its bins empty, so it is no cheaper than rate of these,
+    and for rates 3, 5 and 6 it is not a power of two. The rotated phases are as accurate as the
+    plain one.
+*/
+static q31_t delay_rotation[2 * HALF_FFT_SIZE];
+static int delay_rate = 0;
+
+static void init_rotation(int rate)
 {
-    /* Frequency domain array */
-    q31_t Sw_[FFT_SIZE * 2 + 1] = {0};
+    /* PI_Q28 is 2 pi in Q27, the angle cordic takes */
+    for (int k = 0; k < HALF_FFT_SIZE; k++)
+        cordic((I64(PI_Q28) * k) / (FFT_SIZE * rate), &delay_rotation[2 * k + 1], &delay_rotation[2 * k]);
+
+    delay_rate = rate;
+}
 
+/*
+    The synthesis window Pn stretched over frames of n samples (at 8 kHz) and sampled rate times
+    per 8 kHz sample, for frames other than the plain N_SPF at 8 kHz. The triangle is linear, so
+    interpolating it is exact. Filled in on first use of a frame length and rate.
+*/
+static q31_t frame_window[2 * MAX_N_SPF * MAX_RATE];
+static int window_n = 0, window_rate = 0;
+
+static void init_window(const q31_t Pn[], int n, int rate)
+{
+    for (int i = 0; i < 2 * n * rate; i++)
+    {
+        /* Position in Pn, whole and fraction over n * rate */
+        int position = (i * N_SPF) / (n * rate), fraction = (i * N_SPF) % (n * rate);
+        q31_t next = (position + 1 < 2 * N_SPF) ? Pn[position + 1] : 0;
+
+        frame_window[i] = Pn[position] + (I64(next) - Pn[position]) * fraction / (n * rate);
+    }
+
+    window_n = n;
+    window_rate = rate;
+}
+
+/* Synthesise 2 * n * rate windowed samples of a frame of n samples, rate times 8 kHz, from the
+   spectrum freq_domain_calc built in Sw_. Sw_ is used as scratch */
+void synthesise_spectrum(const fft_engine *fft, q31_t frame[], q31_t Sw_[], const q31_t Pn[], int n, int rate)
+{
     /* Time domain array */
-    q31_t sw_[FFT_SIZE + 2];
+    q31_t sw_[2 * MAX_N_SPF];
 
-    /* Loop counters, indexes, peak amplitude values */
-    int i, j, max_amplitude, abs_value;
+    if (n == N_SPF && rate == 1)
+    {
+        /* Perform inverse FFT to transform the frequency domain back to time domain. Only the
+           2 * N_SPF samples around the start of the frame are needed, the tail of the transform
+           output followed by its head */
+        fft->inverse(Sw_, sw_, FFT_SIZE - N_SPF + 1, 2 * N_SPF);
 
-    /* Shift the existing samples so we can add the new one */
-    shift_left(&Sn_[N_SPF], Sn_, N_SPF - 1);
-    Sn_[N_SPF - 1] = 0;
+        /* Multiply with the synthesis window */
+        for (int i = 0; i < (2 * N_SPF); i++)
+            frame[i] = MUL_SHIFT(sw_[i], Pn[i], Q32BITS);
+
+        return;
+    }
+
+    if (n != window_n || rate != window_rate)
+        init_window(Pn, n, rate);
+
+    if (rate != delay_rate && rate > 1)
+        init_rotation(rate);
+
+    /* The occupied bins, as the next delay starts from them. The inverse transform may use Sw_
+       as scratch */
+    q31_t bins[2 * HALF_FFT_SIZE];
+    int occupied[HALF_FFT_SIZE], count = 0;
+
+    for (int k = 1; k < HALF_FFT_SIZE && rate > 1; k++)
+    {
+        if (!Sw_[2 * k] && !Sw_[2 * k + 1])
+            continue;
+
+        occupied[count++] = k;
+        bins[2 * k] = Sw_[2 * k];
+        bins[2 * k + 1] = Sw_[2 * k + 1];
+    }
+
+    for (int r = 0; r < rate; r++)
+    {
+        if (r > 0)
+        {
+            memset(Sw_, 0, (FFT_SIZE + 2) * sizeof(q31_t));
+
+            /* Delay every bin by another 1 / rate of a sample */
+            for (int j = 0; j < count; j++)
+            {
+                int k = occupied[j];
+                q31_t cos = delay_rotation[2 * k], sin = delay_rotation[2 * k + 1];
+                q31_t re = bins[2 * k], im = bins[2 * k + 1];
+
+                bins[2 * k] = Sw_[2 * k] = (I64(re) * cos - I64(im) * sin) >> Q27BITS;
+                bins[2 * k + 1] = Sw_[2 * k + 1] = (I64(re) * sin + I64(im) * cos) >> Q27BITS;
+            }
+        }
+
+        /* The 2 * n samples around the start of the frame */
+        fft->inverse(Sw_, sw_, FFT_SIZE - n + 1, 2 * n);
+
+        /* Sub-sample r of every 8 kHz sample, windowed */
+        for (int i = 0; i < (2 * n); i++)
+            frame[i * rate + r] = MUL_SHIFT(sw_[i], frame_window[i * rate + r], Q32BITS);
+    }
+}
+
+/* Synthesise 2 * n * rate windowed samples of a frame of n samples, rate times 8 kHz, shaped by
+   the gain curve eq (see codec2_set_eq) */
+void synthesise(const fft_engine *fft, q31_t frame[], MODEL *model, const q31_t Pn[], const q31_t eq[], int n,
+                int rate)
+{
+    /* Frequency domain array */
+    q31_t Sw_[FFT_SIZE * 2 + 1] = {0};
 
     /* Construct the frequency domain from amplitudes and phases stored in frame's model */
-    freq_domain_calc(Sw_, model);
+    freq_domain_calc(Sw_, model, eq);
+    synthesise_spectrum(fft, frame, Sw_, Pn, n, rate);
+}
 
-    /* Perform inverse FFT to transform the frequency domain back to time domain */
-    arm_rfft_q31(fft, Sw_, sw_);
+/* Overlap-add a frame of 2 * n samples, returns the peak of the n finished samples */
+int overlap_add(q31_t Sn_[], const q31_t frame[], int n)
+{
+    /* Loop counters, indexes, peak amplitude values */
+    int i, max_amplitude, abs_value;
+
+    /* Shift the existing samples so we can add the new one */
+    shift_left(&Sn_[n], Sn_, n - 1);
+    Sn_[n - 1] = 0;
 
-    /* Multiply with the synthesis window and copy the samples, while we're
-       at it, find the max_amplitude we'll use later for ear_protection */
-    for (i = 0, max_amplitude = 0; i < (N_SPF - 1); i++)
+    /* Add the overlapping part, while we're at it, find the
+       max_amplitude we'll use later for ear_protection */
+    for (i = 0, max_amplitude = 0; i < (n - 1); i++)
     {
-        Sn_[i] += MUL_SHIFT(sw_[FFT_SIZE - N_SPF + 1 + i], Pn[i], Q32BITS);
+        Sn_[i] += frame[i];
         abs_value = ABS(Sn_[i]);
 
         if (abs_value > max_amplitude)
             max_amplitude = abs_value;
     }
 
-    for (i = N_SPF - 1, j = 0; i < (2 * N_SPF); i++, j++)
-        Sn_[i] = MUL_SHIFT(sw_[j], Pn[i], Q32BITS);
+    for (i = n - 1; i < (2 * n); i++)
+        Sn_[i] = frame[i];
 
     return max_amplitude;
 }
@@ -0,0 +1,103 @@
+/*
+Copyright (c) 2023 Hrvoje Cavrak, David Rowe
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+  See the file LICENSE included with this distribution for more
+  information.
+*/
+
+#include "codec2.h"
+#include "data.h"
+#include "defines.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    Reads the last packets of a file one block and a few packets long, a final block shorter
+    than the warm-up, through codec2_pcm_cache_read, and compares them with the same packets
+    decoded straight from a cursor the way the cache decodes a block. Then checks that blocks
+    are told apart by the equaliser's gains, not by where the curve is.
+*/
+
+#define PACKETS (PCM_CACHE_BLOCK + 5)
+#define FIRST (PACKETS - 2)
+
+int main(void)
+{
+    const char *path = "pcm_cache_test.raw";
+    FILE *file = fopen(path, "wb");
+
+    if (!file || fwrite(coded_data, 7, PACKETS, file) != PACKETS || fclose(file))
+        return 1;
+
+    codec2_reader reader;
+    codec2_pcm_cache cache;
+    codec2_cursor cursor;
+    codec2_state listener;
+
+    if (codec2_reader_open(&reader, path, CODEC2_FORMAT_RAW, 0) || codec2_pcm_cache_open(&cache, 1 << 20))
+        return 1;
+
+    codec2_default_state(&listener);
+
+    const int samples = codec2_samples_per_packet();
+    short *expected = malloc((size_t)(PCM_CACHE_WARMUP + PACKETS) * samples * sizeof(short));
+    short *speech = malloc((size_t)PACKETS * samples * sizeof(short));
+
+    /* The final block starts at PCM_CACHE_BLOCK, the decoder warms up on the packets before it */
+    codec2_cursor_open(&cursor, &reader, PCM_CACHE_BLOCK - PCM_CACHE_WARMUP);
+    codec2_cursor_decode(&cursor, expected, PCM_CACHE_WARMUP + PACKETS - PCM_CACHE_BLOCK);
+    codec2_cursor_close(&cursor);
+
+    const short *tail = expected + (size_t)(PCM_CACHE_WARMUP + FIRST - PCM_CACHE_BLOCK) * samples;
+    int failed = 0;
+
+    /* A miss, then a hit on the block cached by it, both asking for more than there is */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int count = codec2_pcm_cache_read(&cache, &reader, 1, &listener, FIRST, speech, PACKETS);
+
+        if (count != PACKETS - FIRST || memcmp(speech, tail, (size_t)count * samples * sizeof(short)))
+        {
+            printf("pass %d: read %d packets of %d, samples %s\n", pass, count, PACKETS - FIRST,
+                   memcmp(speech, tail, (size_t)(PACKETS - FIRST) * samples * sizeof(short)) ? "differ" : "match");
+            failed = 1;
+        }
+    }
+
+    /* The equaliser counts by its gains: a curve changed in place misses, a copy elsewhere hits */
+    static q31_t curve[EQ_BINS], copy[EQ_BINS];
+    const int hz[] = {300, 2700};
+    const int16_t db[] = {-6, 3};
+
+    codec2_eq_curve(curve, 2, hz, db);
+    memcpy(copy, curve, sizeof(curve));
+    listener.eq = curve;
+    codec2_pcm_cache_read(&cache, &reader, 1, &listener, 0, speech, 1);
+    curve[10] /= 2;
+    codec2_pcm_cache_read(&cache, &reader, 1, &listener, 0, speech, 1);
+    listener.eq = copy;
+    codec2_pcm_cache_read(&cache, &reader, 1, &listener, 0, speech, 1);
+
+    uint64_t hits, misses, bytes_saved;
+    codec2_pcm_cache_stats(&cache, &hits, &misses, &bytes_saved);
+
+    if (hits != 2 || misses != 3)
+    {
+        printf("%llu hits and %llu misses, expected 2 and 3\n", (unsigned long long)hits,
+               (unsigned long long)misses);
+        failed = 1;
+    }
+
+    codec2_pcm_cache_close(&cache);
+    codec2_reader_close(&reader);
+    remove(path);
+    free(expected);
+    free(speech);
+    return failed;
+}
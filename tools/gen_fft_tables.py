@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Hrvoje Cavrak
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+# See the file LICENSE included with this distribution for more
+# information.
+#
+# Generates the FFT tables and statically initialised instances for the real FFT sizes
+# the decoder actually uses, instead of linking every table CMSIS has.
+#
+# Values are taken from the vendored CMSIS fft_tables.h so the transforms stay bit-exact.
+# The real split coefficients are decimated to the one size, so they are read sequentially
+# (twidCoefRModifier = 1) instead of with a stride through the 8192 entry tables.
+#
+# usage: gen_fft_tables.py <cmsis fft_tables.h> <output.c> [--ram] [--align N] size [size ...]
+
+import argparse
+import re
+
+parser = argparse.ArgumentParser()
+parser.add_argument("cmsis_tables")
+parser.add_argument("output")
+parser.add_argument("--ram", action="store_true", help="leave the tables non-const so they are placed in RAM")
+parser.add_argument("--align", type=int, default=32, help="table alignment in bytes")
+parser.add_argument("sizes", type=int, nargs="+", help="real FFT sizes")
+args = parser.parse_args()
+
+source = open(args.cmsis_tables).read()
+
+
+def cmsis_table(name):
+    match = re.search(r"\b%s\[[^\]]*\]\s*=\s*\{(.*?)\};" % name, source, re.S)
+    if not match:
+        raise SystemExit("%s not found in %s" % (name, args.cmsis_tables))
+    return re.findall(r"0[xX][0-9a-fA-F]+", match.group(1))
+
+
+def emit_table(out, ctype, name, values, per_line):
+    qualifier = "" if args.ram else "const "
+    out.append("%s%s %s[%d] __attribute__((aligned(%d))) = {" % (qualifier, ctype, name, len(values), args.align))
+    if ctype == "q31_t":
+        values = ["(q31_t)" + v for v in values]
+    for i in range(0, len(values), per_line):
+        out.append("    " + ", ".join(values[i : i + per_line]) + ",")
+    out.append("};\n")
+
+
+def bit_reverse(value, bits):
+    return int(format(value, "0%db" % bits)[::-1], 2)
+
+
+real_coef_a = cmsis_table("realCoefAQ31")
+real_coef_b = cmsis_table("realCoefBQ31")
+
+out = [
+    "/* Generated by tools/gen_fft_tables.py, do not edit */\n",
+    '#include "dsp/transform_functions.h"\n',
+]
+
+for size in args.sizes:
+    half = size // 2
+    bits = half.bit_length() - 1
+
+    if size < 32 or size > len(real_coef_a) or size & (size - 1):
+        raise SystemExit("unsupported real FFT size %d" % size)
+
+    # The CMSIS tables are laid out for an 8192 point real transform, take every n-th pair
+    modifier = len(real_coef_a) // size
+    coef_a = [v for i in range(half) for v in real_coef_a[2 * i * modifier : 2 * i * modifier + 2]]
+    coef_b = [v for i in range(half) for v in real_coef_b[2 * i * modifier : 2 * i * modifier + 2]]
+
+    twiddle = cmsis_table("twiddleCoef_%d_q31" % half)
+    bitrev = [str(bit_reverse(i, bits)) for i in range(half)]
+
+    out.append("/* %d point real FFT, %d point complex FFT underneath */\n" % (size, half))
+    emit_table(out, "q31_t", "twiddle_%d_q31" % half, twiddle, 6)
+    emit_table(out, "q31_t", "rfft_coef_a_%d_q31" % size, coef_a, 6)
+    emit_table(out, "q31_t", "rfft_coef_b_%d_q31" % size, coef_b, 6)
+    emit_table(out, "uint8_t" if half <= 256 else "uint16_t", "bitrev_%d" % half, bitrev, 16)
+
+    # Output of the complex FFT is left in bit-reversed order, see src/fft.c
+    out.append("const arm_cfft_instance_q31 cfft_%d = {%d, twiddle_%d_q31, 0, 0};\n" % (half, half, half))
+
+    for name, inverse in (("rfft", 0), ("irfft", 1)):
+        out.append(
+            "const arm_rfft_instance_q31 %s_%d = {%dU, %d, 0, 1U, rfft_coef_a_%d_q31, rfft_coef_b_%d_q31, &cfft_%d};\n"
+            % (name, size, size, inverse, size, size, half)
+        )
+
+open(args.output, "w").write("\n".join(out))